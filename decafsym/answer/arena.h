@@ -0,0 +1,112 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <vector>
+
+// Bump allocator that owns every AST node of a compilation unit. Nodes are
+// never freed individually: release() hands all blocks back at once, so
+// nothing allocated here may own memory outside the arena.
+class Arena {
+    static const size_t BlockSize = 64 * 1024;
+
+    std::vector<char*> blocks;
+    char  *cur = nullptr;
+    char  *end = nullptr;
+
+    size_t allocations = 0;   // objects handed out since the last release()
+    size_t bytes = 0;         // bytes handed out since the last release()
+
+    char* newBlock(size_t size) {
+        char *b = static_cast<char*>(std::malloc(size));
+        if (!b) throw std::bad_alloc();
+        blocks.push_back(b);
+        return b;
+    }
+
+public:
+    Arena() {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() { release(); }
+
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+        ++allocations;
+        bytes += size;
+        size_t pad = (align - reinterpret_cast<uintptr_t>(cur) % align) % align;
+        if (cur && pad + size <= size_t(end - cur)) {
+            void *p = cur + pad;
+            cur += pad + size;
+            return p;
+        }
+        if (size > BlockSize / 4) {
+            // oversized requests get a block of their own so the current
+            // block keeps its free tail
+            return newBlock(size);
+        }
+        cur = newBlock(BlockSize);
+        end = cur + BlockSize;
+        void *p = cur;
+        cur += size;
+        return p;
+    }
+
+    template <class T>
+    T* allocateArray(size_t n) {
+        return static_cast<T*>(allocate(n * sizeof(T), alignof(T)));
+    }
+
+    // Copies text into the arena; the view stays valid until release().
+    std::string_view copyString(std::string_view s) {
+        char *p = allocateArray<char>(s.size());
+        if (!s.empty()) std::memcpy(p, s.data(), s.size());
+        return std::string_view(p, s.size());
+    }
+
+    // Takes over every block of `other`, which is left empty; the memory then
+    // lives until this arena's release().
+    void adopt(Arena &other) {
+        blocks.insert(blocks.end(), other.blocks.begin(), other.blocks.end());
+        allocations += other.allocations;
+        bytes += other.bytes;
+        other.blocks.clear();
+        other.cur = other.end = nullptr;
+        other.allocations = other.bytes = 0;
+    }
+
+    void release() {
+        for (char *b : blocks) std::free(b);
+        blocks.clear();
+        cur = end = nullptr;
+        allocations = bytes = 0;
+    }
+
+    size_t numAllocations() const { return allocations; }
+    size_t numBytes() const { return bytes; }
+    size_t numBlocks() const { return blocks.size(); }
+};
+
+extern thread_local Arena gArena;
+
+// Standard allocator over gArena, for containers held by AST nodes.
+// deallocate() is a no-op; the memory goes away with the arena.
+template <class T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+    ArenaAllocator() {}
+    template <class U> ArenaAllocator(const ArenaAllocator<U>&) {}
+
+    T* allocate(size_t n) { return gArena.allocateArray<T>(n); }
+    void deallocate(T*, size_t) {}
+
+    template <class U> bool operator==(const ArenaAllocator<U>&) const { return true; }
+    template <class U> bool operator!=(const ArenaAllocator<U>&) const { return false; }
+};
+
+#endif // ARENA_H
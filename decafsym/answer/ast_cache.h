@@ -0,0 +1,143 @@
+#ifndef AST_CACHE_H
+#define AST_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only mapping of a whole file. ok() is false if the file could not be
+// opened or mapped; an empty file maps to an empty view.
+class MappedFile {
+    const char *base = nullptr;
+    size_t      len = 0;
+    bool        good = false;
+
+public:
+    explicit MappedFile(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            len = st.st_size;
+            if (len == 0) {
+                good = true;
+            } else {
+                void *p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    base = static_cast<const char*>(p);
+                    good = true;
+                }
+            }
+        }
+        close(fd);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { if (base) munmap(const_cast<char*>(base), len); }
+
+    bool ok() const { return good; }
+    const char* data() const { return base; }
+    size_t size() const { return len; }
+    std::string_view view() const { return std::string_view(base, len); }
+};
+
+// Layout of an AST image, the file the AST cache writes next to a source
+// file. Everything is a little-endian 32-bit word or a length-prefixed byte
+// string padded to a word boundary:
+//
+//   header
+//   names     header.names strings, the identifiers in first-use order
+//   nodes     header.nodes records in post-order, children before parents:
+//             kind, line, then the node's fields in declaration order; a
+//             child is the index of its record (~0 for none), a name an
+//             index into `names`, a list its length followed by its elements
+//
+// The root is the last record. A header whose magic, version, layout, source
+// size or source hash differs from the current source and compiler means the
+// image is stale. `layout` fingerprints the node kinds and their fields, so
+// adding, reordering or retyping a field invalidates old images without a
+// version bump.
+struct AstImageHeader {
+    static const uint32_t Magic = 0x54534144;   // "DAST"
+    static const uint32_t Version = 3;
+
+    uint32_t magic = Magic;
+    uint32_t version = Version;
+    uint64_t layout = 0;
+    uint64_t sourceHash = 0;
+    uint64_t sourceSize = 0;
+    uint32_t names = 0;
+    uint32_t nodes = 0;
+};
+
+class AstImageWriter {
+    std::string buf;
+
+public:
+    explicit AstImageWriter(const AstImageHeader &h) { buf.append(reinterpret_cast<const char*>(&h), sizeof h); }
+
+    void word(uint32_t v) { buf.append(reinterpret_cast<const char*>(&v), sizeof v); }
+    void bytes(std::string_view s) {
+        word(s.size());
+        buf.append(s.data(), s.size());
+        buf.append((4 - s.size() % 4) % 4, '\0');
+    }
+    // The header fields only known at the end (names, nodes).
+    AstImageHeader& header() { return *reinterpret_cast<AstImageHeader*>(&buf[0]); }
+    const std::string& image() const { return buf; }
+};
+
+// Cursor over an image. Reading past the end yields zeroes and clears ok(),
+// so a truncated file is detected once, after the fact.
+class AstImageReader {
+    const char *cur, *end;
+    bool good = true;
+
+public:
+    AstImageReader(const char *p, size_t n) : cur(p), end(p + n) {}
+
+    bool header(AstImageHeader &h) {
+        if (size_t(end - cur) < sizeof h) return good = false;
+        std::memcpy(&h, cur, sizeof h);
+        cur += sizeof h;
+        return h.magic == AstImageHeader::Magic && h.version == AstImageHeader::Version;
+    }
+    uint32_t word() {
+        uint32_t v = 0;
+        if (size_t(end - cur) < sizeof v) { good = false; return 0; }
+        std::memcpy(&v, cur, sizeof v);
+        cur += sizeof v;
+        return v;
+    }
+    std::string_view bytes() {
+        size_t n = word();
+        size_t padded = n + (4 - n % 4) % 4;
+        if (!good || size_t(end - cur) < padded) { good = false; return std::string_view(); }
+        std::string_view s(cur, n);
+        cur += padded;
+        return s;
+    }
+    bool ok() const { return good; }
+    bool atEnd() const { return cur == end; }
+};
+
+// Writes `image` to `path` through a temporary file, so a reader never maps
+// a partly written image.
+inline bool writeAstImage(const std::string &path, const std::string &image) {
+    std::string tmp = path + ".tmp" + std::to_string(getpid());
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+    bool ok = fwrite(image.data(), 1, image.size(), f) == image.size();
+    ok = fclose(f) == 0 && ok;
+    if (ok) ok = std::rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) std::remove(tmp.c_str());
+    return ok;
+}
+
+#endif // AST_CACHE_H
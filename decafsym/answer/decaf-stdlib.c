@@ -1,18 +1,107 @@
 
-
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Output is collected in a private buffer and written to fd 1 in large
+   blocks: at exit, before reading stdin (so prompts appear), when the buffer
+   fills, and after each newline when stdout is a terminal, which is when
+   printf would have flushed it. Integers are formatted two digits at a time
+   and read_int parses its digits itself; neither goes through a format
+   string or takes the stdio lock per call. The bytes written are the ones
+   printf("%d") / printf("%s") would write. Externs that write to stdout
+   through stdio are not ordered against this buffer. */
+
+#define DECAF_OUT_SIZE (1 << 16)
+
+static char decaf_out[DECAF_OUT_SIZE];
+static size_t decaf_out_len;
+static int decaf_tty;
+
+static const char decaf_digit_pairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+static void decaf_write(const char *s, size_t n) {
+  while (n) {
+    ssize_t done = write(1, s, n);
+    if (done < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    s += done;
+    n -= done;
+  }
+}
+
+void decaf_flush(void) {
+  decaf_write(decaf_out, decaf_out_len);
+  decaf_out_len = 0;
+}
+
+__attribute__((constructor)) static void decaf_init(void) {
+  decaf_tty = isatty(1);
+  atexit(decaf_flush);
+}
+
+static void decaf_put(const char *s, size_t n) {
+  if (n > DECAF_OUT_SIZE - decaf_out_len) {
+    decaf_flush();
+    if (n >= DECAF_OUT_SIZE) {
+      decaf_write(s, n);
+      return;
+    }
+  }
+  memcpy(decaf_out + decaf_out_len, s, n);
+  decaf_out_len += n;
+}
 
 void print_int(int x) {
-  printf("%d", x);
+  char digits[12];
+  char *end = digits + sizeof digits, *p = end;
+  unsigned u = x < 0 ? 0u - (unsigned)x : (unsigned)x;
+  while (u >= 100) {
+    unsigned q = u / 100;
+    p -= 2;
+    memcpy(p, decaf_digit_pairs + 2 * (u - q * 100), 2);
+    u = q;
+  }
+  if (u >= 10) {
+    p -= 2;
+    memcpy(p, decaf_digit_pairs + 2 * u, 2);
+  } else {
+    *--p = (char)('0' + u);
+  }
+  if (x < 0) *--p = '-';
+  decaf_put(p, end - p);
 }
 
 void print_string(const char *s) {
-  printf("%s", s);
+  size_t n = strlen(s);
+  decaf_put(s, n);
+  if (decaf_tty && memchr(s, '\n', n)) decaf_flush();
 }
 
+/* Reads like scanf("%d"): skips white space, takes an optional sign and
+   the digits after it, and leaves the first character that is not part of
+   the number unread. Out-of-range values wrap to int; 0 if there is no
+   number. */
 int read_int() {
-  int i;
-  scanf("%d", &i);
-  return i;
+  unsigned v = 0;
+  int c, neg = 0;
+  if (decaf_out_len) decaf_flush();
+  do c = getc_unlocked(stdin); while (c == ' ' || (c >= '\t' && c <= '\r'));
+  if (c == '-' || c == '+') {
+    neg = c == '-';
+    c = getc_unlocked(stdin);
+  }
+  while (c >= '0' && c <= '9') {
+    v = v * 10 + (unsigned)(c - '0');
+    c = getc_unlocked(stdin);
+  }
+  if (c != EOF) ungetc(c, stdin);
+  return neg ? (int)(0u - v) : (int)v;
 }
-
@@ -1,10 +1,111 @@
 #include "default-defs.h"
-#include <list>
 #include <ostream>
 #include <iostream>
 #include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <type_traits>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/resource.h>
 #include "symbol_table.h"
-SymbolStack gSym;  
+#include "arena.h"
+#include "small_deque.h"
+#include "diagnostics.h"
+#include "thread_pool.h"
+#include "program_gen.h"
+#include "method_cache.h"
+#include "ast_cache.h"
+#include "source_buffer.h"
+#include "fast_scan.h"
+#ifdef DECAF_CODEGEN
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_os_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include <spawn.h>
+#include <sys/wait.h>
+#endif
+// Per-compilation state. Each thread compiles one file at a time and resets
+// these between files, so batch workers never share them.
+thread_local Arena gArena;
+thread_local Interner gNames;
+thread_local SymbolStack gSym;  
+thread_local Diagnostics gDiag;
+thread_local BindingTable gDecls;
+// The mapped source being parsed, when there is one; token text that still
+// lies inside it is kept by reference instead of copied.
+thread_local const SourceBuffer *gSource = nullptr;
+
+// Knobs the driver sets before calling Analyze().
+struct CompileOptions {
+    // Method bodies are analyzed on this many threads once the program and
+    // package scopes are complete; 1 keeps everything on the calling thread.
+    unsigned analyzeThreads = 1;
+    // Files compiled at once in batch mode; 0 means one per hardware thread.
+    unsigned jobs = 0;
+    // Batch mode writes <outputDir>/<group>/<name>.out/.err/.ret, where the
+    // group is the name of the directory holding the .decaf file.
+    std::string outputDir = "output";
+    // Print per-phase times (and counters, in DECAF_STATS builds) to stderr.
+    bool stats = false;
+    // Blocks, method bodies and for loops keep a persistent snapshot of the
+    // names visible on entry (entryScope()); nothing in the compiler reads
+    // them, so they cost nothing unless asked for (--scope-snapshots).
+    bool scopeSnapshots = false;
+    // How each compile's diagnostics are written (--diagnostics=json), and
+    // whether the "defined variable" traces are among them (--no-traces).
+    Diagnostics::Format diagFormat = Diagnostics::Text;
+    bool traces = true;
+    // Batch mode loads each file's tree from <file>.ast when that image was
+    // made from the same source, and writes the image otherwise.
+    bool astCache = false;
+    // Batch mode maps each file and has the scanner work on it in place.
+    bool mmapInput = false;
+    // Run the constant folding pass after analysis.
+    bool fold = false;
+    // Report expressions whose type does not fit where they are used; the
+    // analysis types every expression either way.
+    bool typeCheck = false;
+#ifdef DECAF_CODEGEN
+    // Fold and generate LLVM IR after analysis; the IR goes where the
+    // diagnostics go. On in decafexpr unless --no-codegen is given.
+    bool codegen = true;
+    // Level of the LLVM pipeline run over the module (-O<n>); 0 runs none.
+    unsigned optLevel = 0;
+    // JIT-compile the program and run it in process instead of printing it.
+    bool run = false;
+    // Write a relocatable object, and/or link an executable against
+    // `runtime`, instead of printing the IR.
+    std::string objectFile, executable;
+    std::string runtime = "decaf-stdlib.o";
+#else
+    static constexpr bool codegen = false;
+#endif
+    // Per-method analysis results are reused from here when a method and
+    // everything it can see are unchanged; empty disables the cache.
+    std::string cacheDir;
+};
+CompileOptions gOptions;
 
 #ifndef YYTOKENTYPE
 #endif
@@ -16,20 +117,281 @@ inline void printIndent(std::ostream& out, int indent) {
     for (int i = 0; i < indent; ++i) out << "  ";
 }
 
+// Every concrete node class, in definition order. Expanded to build the
+// ASTKind tag each node carries, the forward declarations below, and the
+// switch in dispatch().
+#define DECAF_AST_NODES(X) \
+  X(IntTypeAST) \
+  X(BoolTypeAST) \
+  X(StringTypeAST) \
+  X(VoidTypeAST) \
+  X(VarDeclAST) \
+  X(decafStmtList) \
+  X(PackageAST) \
+  X(ProgramAST) \
+  X(FieldDeclAST) \
+  X(FieldDeclArrayAST) \
+  X(ArrayLocExprAST) \
+  X(AssignArrayLocAST) \
+  X(ArrayFieldDeclAST) \
+  X(VariableAST) \
+  X(AssignAST) \
+  X(MethodBlockAST) \
+  X(BlockAST) \
+  X(MethodDeclAST) \
+  X(MethodCallAST) \
+  X(ContinueStmtAST) \
+  X(IntConstantAST) \
+  X(UnaryMinusAST) \
+  X(NotAST) \
+  X(CharConstantAST) \
+  X(BoolExprAST) \
+  X(StringConstantAST) \
+  X(TypeOnlyVarDefAST) \
+  X(BoolConstantAST) \
+  X(AssignGlobalVarAST) \
+  X(WhileStmtAST) \
+  X(BreakStmtAST) \
+  X(IfStmtAST) \
+  X(ReturnStmtAST) \
+  X(ExternFunctionAST) \
+  X(VarDefAST) \
+  X(ForStmtAST) \
+  X(PlusAST) \
+  X(MinusAST) \
+  X(MultAST) \
+  X(DivAST) \
+  X(ModAST) \
+  X(LeftShiftAST) \
+  X(RightShiftAST) \
+  X(LessThanAST) \
+  X(GreaterThanAST) \
+  X(LessEqualAST) \
+  X(GreaterEqualAST) \
+  X(EqualAST) \
+  X(NotEqualAST) \
+  X(AndAST) \
+  X(OrAST)
+
+#define X(C) C,
+enum class ASTKind : unsigned char { DECAF_AST_NODES(X) NumKinds };
+#undef X
+
+#define X(C) class C;
+DECAF_AST_NODES(X)
+#undef X
+
+inline const char* kindName(ASTKind k) {
+    static const char* const names[] = {
+#define X(C) #C,
+        DECAF_AST_NODES(X)
+#undef X
+    };
+    return names[static_cast<int>(k)];
+}
+
+template <class T> struct KindOf;
+#define X(C) template <> struct KindOf<C> { static const ASTKind value = ASTKind::C; };
+DECAF_AST_NODES(X)
+#undef X
+
+// Sink for decafAST::serialize(). Forwards to an ostream and counts what has
+// been written so writeCommaList() can place commas exactly where commaList()
+// does without building the child strings first.
+class AstWriter {
+    std::ostream &out;
+    size_t written = 0;
+public:
+    explicit AstWriter(std::ostream &o) : out(o) {}
+    size_t size() const { return written; }
+
+    AstWriter& operator<<(std::string_view s) {
+        out.write(s.data(), s.size());
+        written += s.size();
+        return *this;
+    }
+    AstWriter& operator<<(const char *s) { return *this << std::string_view(s); }
+    AstWriter& operator<<(Ident id) { return *this << std::string_view(id.str()); }
+    AstWriter& operator<<(char c) { out.put(c); ++written; return *this; }
+    AstWriter& operator<<(int v) {
+        char buf[16];
+        int n = snprintf(buf, sizeof buf, "%d", v);
+        return *this << std::string_view(buf, n);
+    }
+};
+
+class AnalyzeWalker;
+class PrintWalker;
+
+// Selects the constructor the AST cache loader uses; it leaves the fields
+// for fields() to fill in.
+struct AstLoadTag {};
+
+// Type of the nodes whose type follows from their kind: constants and
+// operators. Everything else starts out TYPE_UNKNOWN.
+inline DecafType typeOfKind(ASTKind k) {
+  switch (k) {
+  case ASTKind::IntConstantAST: case ASTKind::CharConstantAST:
+  case ASTKind::UnaryMinusAST:
+  case ASTKind::PlusAST: case ASTKind::MinusAST: case ASTKind::MultAST: case ASTKind::DivAST:
+  case ASTKind::ModAST: case ASTKind::LeftShiftAST: case ASTKind::RightShiftAST:
+    return TYPE_INT;
+  case ASTKind::BoolConstantAST: case ASTKind::BoolExprAST: case ASTKind::NotAST:
+  case ASTKind::LessThanAST: case ASTKind::GreaterThanAST: case ASTKind::LessEqualAST:
+  case ASTKind::GreaterEqualAST: case ASTKind::EqualAST: case ASTKind::NotEqualAST:
+  case ASTKind::AndAST: case ASTKind::OrAST:
+    return TYPE_BOOL;
+  case ASTKind::StringConstantAST:
+    return TYPE_STRING;
+  default:
+    return TYPE_UNKNOWN;
+  }
+}
+
 class decafAST {
 protected:
+    ASTKind kind;
+    unsigned char exprType;   // a DecafType; fits in the padding after kind
     int line;
 public:
-    decafAST(int l = -1) : line(l) {}
+    decafAST(ASTKind k, int l = -1) : kind(k), exprType(typeOfKind(k)), line(l) {
+      DECAF_COUNT(++nodesByKind[static_cast<int>(k)]);
+    }
     virtual ~decafAST() {}
+    // Nodes live in gArena and are reclaimed all at once by gArena.release();
+    // delete on a node is a no-op.
+    static void* operator new(size_t size) { return gArena.allocate(size); }
+    static void operator delete(void*) {}
+#ifdef DECAF_STATS
+    static inline thread_local uint64_t nodesByKind[static_cast<int>(ASTKind::NumKinds)] = {};
+#endif
     virtual std::string str() { return ""; }
-    virtual void Analyze() {}
-    virtual void prettyPrint(std::ostream& out, int indent = 0) {}
+    // Streams the same text as str() in one pass, with no intermediate strings.
+    virtual void serialize(AstWriter& w) {}
+    void writeStr(std::ostream& out) { AstWriter w(out); serialize(w); }
+    // Both run on an explicit work stack (see TreeWalker), so arbitrarily
+    // deep trees do not overflow the native stack.
+    void Analyze();
+    // Folds constant subexpressions in place; run after Analyze().
+    void Fold();
+    void prettyPrint(std::ostream& out, int indent = 0);
+    // Per-node steps the walkers reach through dispatch(). Subclasses hide
+    // these; they are deliberately not virtual.
+    void analyzeStep(AnalyzeWalker& w) {}
+    void analyzeExit(AnalyzeWalker& w) {}
+    void printStep(PrintWalker& w, int indent) {}
+    // Hands each field, children included, to `f` in declaration order;
+    // the AST cache writes and reads nodes through this.
+    template <class F> void fields(F &f) {}
+    ASTKind getKind() const { return kind; }
     int getLine() const { return line; }
     void setLine(int l) { line = l; }
+    // Type of the value this node computes; TYPE_UNKNOWN for statements,
+    // declarations and uses that did not resolve. Constants and operators
+    // have it from construction, Analyze() sets it on names, array reads
+    // and calls.
+    DecafType getExprType() const { return DecafType(exprType); }
+    void setExprType(DecafType t) { exprType = t; }
+
+};
 
+// Work stack behind Analyze() and prettyPrint(). Visiting a node runs its
+// step method, which does the node's own work and schedules its children and
+// any trailing work in program order; the walker then pops tasks one at a
+// time. Depth is bounded by heap memory instead of the thread stack, and the
+// scope push/pop order matches the recursive version exactly.
+struct WalkTask {
+    enum Op : unsigned char { Visit, Exit, PushScope, PopScope, Text, Indent, Number };
+    Op               op;
+    int              arg;    // indent for Visit and Indent, value for Number
+    decafAST        *node;
+    std::string_view text;
 };
 
+class TreeWalker {
+protected:
+    std::vector<WalkTask> tasks;
+    size_t mark = 0;         // first task scheduled by the current step
+    std::vector<decafAST*> *visited = nullptr;
+
+    void schedule(WalkTask::Op op, decafAST *n, int arg = 0, std::string_view text = {}) {
+        tasks.push_back(WalkTask{op, arg, n, text});
+    }
+
+    bool next(WalkTask &t) {
+        // the last step scheduled its tasks in program order; flip them so
+        // the first one is popped first
+        std::reverse(tasks.begin() + mark, tasks.end());
+        if (tasks.empty()) return false;
+        t = tasks.back();
+        tasks.pop_back();
+        mark = tasks.size();
+        if (visited && t.op == WalkTask::Visit) visited->push_back(t.node);
+        return true;
+    }
+
+public:
+    // Appends every node the walk visits to `v`, in visiting order.
+    void recordVisits(std::vector<decafAST*> *v) { visited = v; }
+};
+
+class AnalyzeWalker : public TreeWalker {
+public:
+    SymbolStack &sym;
+    Diagnostics &diag;
+
+    // Return type and name of the method whose body is being walked.
+    DecafType returnType = TYPE_UNKNOWN;
+    SymbolId  method = 0;
+
+    AnalyzeWalker(SymbolStack &s, Diagnostics &d) : sym(s), diag(d) {}
+    void child(decafAST *n) { if (n) schedule(WalkTask::Visit, n); }
+    void exit(decafAST *n) { schedule(WalkTask::Exit, n); }
+    void pushScope() { schedule(WalkTask::PushScope, nullptr); }
+    void popScope() { schedule(WalkTask::PopScope, nullptr); }
+    void run(decafAST *root) { child(root); drain(); }
+    // Runs everything scheduled so far to completion.
+    void drain();
+
+    // Reports `e`, described by `what` (and `name`), unless it has type
+    // `want`. Unknown types pass: they come from uses that did not resolve,
+    // which have been reported already.
+    void expect(decafAST *e, DecafType want, const char *what, int line) {
+        if (mismatched(e, want)) diag.mismatch(what, NoName, e->getExprType(), want, line);
+    }
+    void expect(decafAST *e, DecafType want, const char *what, SymbolId name, int line) {
+        if (mismatched(e, want)) diag.mismatch(what, name, e->getExprType(), want, line);
+    }
+    static bool mismatched(decafAST *e, DecafType want) {
+        DecafType t = e ? e->getExprType() : TYPE_UNKNOWN;
+        return t != want && t != TYPE_UNKNOWN && want != TYPE_UNKNOWN;
+    }
+};
+
+class PrintWalker : public TreeWalker {
+    std::ostream &out;
+public:
+    explicit PrintWalker(std::ostream &o) : out(o) {}
+    void child(decafAST *n, int indent) { if (n) schedule(WalkTask::Visit, n, indent); }
+    // `s` must outlive the walk: literals and interned spellings do.
+    void text(std::string_view s) { schedule(WalkTask::Text, nullptr, 0, s); }
+    void indent(int n) { schedule(WalkTask::Indent, nullptr, n); }
+    void number(int v) { schedule(WalkTask::Number, nullptr, v); }
+    void run(decafAST *root, int indent);
+};
+
+// Checked downcast on the node's kind tag instead of RTTI. Only matches the
+// exact class; ArrayFieldDeclAST is not a FieldDeclAST here.
+template <class T>
+inline T* dyn_cast(decafAST *d) {
+  return (d && d->getKind() == KindOf<T>::value) ? static_cast<T*>(d) : nullptr;
+}
+
+// Line of the declaration a use resolved to, or -1 if it did not resolve.
+inline int declLineOf(DeclId id) {
+  return id == NoDecl ? -1 : gDecls[id].line;
+}
+
 string getString(decafAST *d) {
   if (d != NULL) {
     return d->str();
@@ -38,10 +400,10 @@ string getString(decafAST *d) {
   }
 }
 
-template <class T>
-string commaList(list<T> vec) {
+template <class L>
+string commaList(const L &vec) {
   string s("");
-  for (typename list<T>::iterator i = vec.begin(); i != vec.end(); ++i) {
+  for (auto i = vec.begin(); i != vec.end(); ++i) {
     s = s + (s.empty() ? string("") : string(",")) + (*i)->str();
   }
   if (s.empty()) {
@@ -50,37 +412,61 @@ string commaList(list<T> vec) {
   return s;
 }
 
+void writeString(AstWriter& w, decafAST *d) {
+  if (d != NULL) {
+    d->serialize(w);
+  } else {
+    w << "None";
+  }
+}
+
+template <class L>
+void writeCommaList(AstWriter& w, const L &vec) {
+  size_t start = w.size();
+  for (auto i = vec.begin(); i != vec.end(); ++i) {
+    if (w.size() != start) w << ',';
+    (*i)->serialize(w);
+  }
+  if (w.size() == start) {
+    w << "None";
+  }
+}
+
 // Analyze for these ?? 
 class IntTypeAST : public decafAST {
 public:
-  void prettyPrint(std::ostream& out, int indent = 0) override {
-    out << "int"; 
-  }
+  explicit IntTypeAST(AstLoadTag) : decafAST(ASTKind::IntTypeAST) {}
+  IntTypeAST() : decafAST(ASTKind::IntTypeAST) {}
+  void printStep(PrintWalker& w, int indent) { w.text("int"); }
   string str()  override  { return string("IntType"); }
+  void serialize(AstWriter& w) override { w << "IntType"; }
 };
 
 class BoolTypeAST : public decafAST {
 public:
-  void prettyPrint(std::ostream& out, int indent = 0) override {
-    out << "bool"; 
-  }
+  explicit BoolTypeAST(AstLoadTag) : decafAST(ASTKind::BoolTypeAST) {}
+  BoolTypeAST() : decafAST(ASTKind::BoolTypeAST) {}
+  void printStep(PrintWalker& w, int indent) { w.text("bool"); }
   string str()  override { return "BoolType"; }
+  void serialize(AstWriter& w) override { w << "BoolType"; }
 };
 
 class StringTypeAST : public decafAST {
 public:
-  void prettyPrint(std::ostream& out, int indent = 0) override {
-    out << "string"; 
-  }
+  explicit StringTypeAST(AstLoadTag) : decafAST(ASTKind::StringTypeAST) {}
+  StringTypeAST() : decafAST(ASTKind::StringTypeAST) {}
+  void printStep(PrintWalker& w, int indent) { w.text("string"); }
   string str() override  { return "StringType"; }
+  void serialize(AstWriter& w) override { w << "StringType"; }
 };
 
 class VoidTypeAST : public decafAST {
 public:
-  void prettyPrint(std::ostream& out, int indent = 0) override {
-    out << "void"; 
-  }
+  explicit VoidTypeAST(AstLoadTag) : decafAST(ASTKind::VoidTypeAST) {}
+  VoidTypeAST() : decafAST(ASTKind::VoidTypeAST) {}
+  void printStep(PrintWalker& w, int indent) { w.text("void"); }
   string str()  override  { return string("VoidType"); }
+  void serialize(AstWriter& w) override { w << "VoidType"; }
 };
 
 
@@ -88,102 +474,119 @@ public:
 // Helper Functions 
 inline DecafType astToType(decafAST* t) {
 
-  if (dynamic_cast<IntTypeAST*>(t))    return TYPE_INT;
-  if (dynamic_cast<BoolTypeAST*>(t))   return TYPE_BOOL;
-  if (dynamic_cast<StringTypeAST*>(t)) return TYPE_STRING;
-  if (dynamic_cast<VoidTypeAST*>(t))   return TYPE_VOID;
-  return TYPE_UNKNOWN;
+  if (!t) return TYPE_UNKNOWN;
+  switch (t->getKind()) {
+    case ASTKind::IntTypeAST:    return TYPE_INT;
+    case ASTKind::BoolTypeAST:   return TYPE_BOOL;
+    case ASTKind::StringTypeAST: return TYPE_STRING;
+    case ASTKind::VoidTypeAST:   return TYPE_VOID;
+    default:                     return TYPE_UNKNOWN;
+  }
 }
 
 
 class VarDeclAST : public decafAST {
-    std::string name;
+    Ident       name;
     decafAST   *type;
 public:
-    VarDeclAST(const std::string& id, decafAST* t, int l)
-        : decafAST(l), name(id), type(t) {}
-    ~VarDeclAST() { delete type; }
-
-    void Analyze() override {
+    explicit VarDeclAST(AstLoadTag) : decafAST(ASTKind::VarDeclAST) {}
+    template <class F> void fields(F &f) { f(name); f(type); }
+    VarDeclAST(Ident id, decafAST* t, int l)
+        : decafAST(ASTKind::VarDeclAST, l), name(id), type(t) {}
+    Ident getName() const { return name; }
+    decafAST* getType() const { return type; }
+
+    void analyzeStep(AnalyzeWalker& w) {
         DecafType dtype = astToType(type);
-        if (!gSym.insert(name, dtype, getLine())) {
-            std::cerr << "Error: parameter '" << name
-                      << "' redeclared (line " << getLine() << ")\n";
+        if (!w.sym.insert(name, dtype, getLine(), this)) {
+            w.diag.redeclared("parameter", name, getLine());
         } else {                                        
-            std::cerr << "defined variable: " << name
-                      << ", with type: " << typeToString(dtype)
-                      << ", on line number: " << getLine() << '\n';
+            w.diag.defined(name, dtype, getLine());
         }
     }
     
-    void prettyPrint(std::ostream& out, int indent = 0) override {
-      printIndent(out, indent);
-      out << "var " << name << " ";
-      if (type) type->prettyPrint(out, 0);
-      out << "; \n";
+    void printStep(PrintWalker& w, int indent) {
+      w.indent(indent);
+      w.text("var "); w.text(name.str()); w.text(" ");
+      w.child(type, 0);
+      w.text("; \n");
     }
 
     std::string str() override {
-        return "VarDef(" + name + "," + getString(type) + ")";
+        return "VarDef(" + name.str() + "," + getString(type) + ")";
+    }
+    void serialize(AstWriter& w) override {
+        w << "VarDef(" << name << ","; writeString(w, type); w << ")";
     }
 };
 
 
+typedef SmallDeque<decafAST *, 4> StmtList;
+
 class decafStmtList : public decafAST {
-  std::list<decafAST *> stmts;
+  StmtList stmts;
 public:
-  decafStmtList(int l = -1) : decafAST(l) {}
-  ~decafStmtList() {
-    for (auto *p : stmts) delete p;
-  }
+  explicit decafStmtList(AstLoadTag) : decafAST(ASTKind::decafStmtList) {}
+  template <class F> void fields(F &f) { f(stmts); }
+  decafStmtList(int l = -1) : decafAST(ASTKind::decafStmtList, l) {}
   int size() { return stmts.size(); }
   void push_front(decafAST *e) { stmts.push_front(e); }
   void push_back(decafAST *e) { stmts.push_back(e); }
-  const std::list<decafAST*>& getStmts() const { return stmts; }
+  const StmtList& getStmts() const { return stmts; }
   void merge(decafStmtList *other) {
     if (!other) return;
-    stmts.splice(stmts.end(), other->stmts);
+    stmts.splice_back(other->stmts);
   }
-  void Analyze() override {
-    for (auto *stmt : stmts) if (stmt) stmt->Analyze();
+  void analyzeStep(AnalyzeWalker& w) {
+    for (auto *stmt : stmts) w.child(stmt);
   }
  
-  void prettyPrint(std::ostream& out, int indent = 0) override {
-    for (auto *stmt : stmts) {
-        if (stmt) stmt->prettyPrint(out, indent);
-    }
+  void printStep(PrintWalker& w, int indent) {
+    for (auto *stmt : stmts) w.child(stmt, indent);
   }
 
-  string str()  override { return commaList<decafAST *>(stmts); }
+  string str()  override { return commaList(stmts); }
+  void serialize(AstWriter& w) override { writeCommaList(w, stmts); }
 };
 
 
 class PackageAST : public decafAST {
-  string Name;
+  Ident Name;
   decafStmtList *FieldDeclList;
   decafStmtList *MethodDeclList;
 public:
-  PackageAST(const std::string& name, decafStmtList* f, decafStmtList* m, int l) 
-      : decafAST(l), Name(name), FieldDeclList(f), MethodDeclList(m) {}
-  ~PackageAST() {
-    delete FieldDeclList;
-    delete MethodDeclList;
+  explicit PackageAST(AstLoadTag) : decafAST(ASTKind::PackageAST) {}
+  template <class F> void fields(F &f) { f(Name); f(FieldDeclList); f(MethodDeclList); }
+  PackageAST(Ident name, decafStmtList* f, decafStmtList* m, int l) 
+      : decafAST(ASTKind::PackageAST, l), Name(name), FieldDeclList(f), MethodDeclList(m) {}
+  decafStmtList* getFieldDecls() const { return FieldDeclList; }
+  decafStmtList* getMethodDecls() const { return MethodDeclList; }
+  void analyzeStep(AnalyzeWalker& w) {
+    w.pushScope();
+    w.child(FieldDeclList);
+    if (MethodDeclList && MethodDeclList->size() > 0 &&
+        (gOptions.analyzeThreads > 1 || !gOptions.cacheDir.empty()))
+        w.exit(this);
+    else
+        w.child(MethodDeclList);
+    w.popScope();
   }
-  void Analyze() override {
-    gSym.push();
-    if (FieldDeclList) FieldDeclList->Analyze();
-    if (MethodDeclList) MethodDeclList->Analyze();
-    gSym.pop();
-  }
-  void prettyPrint(std::ostream& out, int indent = 0) override {
-    printIndent(out, indent); out << "package " << Name << " {\n";
-    if (FieldDeclList) FieldDeclList->prettyPrint(out, indent+1);
-    if (MethodDeclList) MethodDeclList->prettyPrint(out, indent+1);
-    printIndent(out, indent); out << "}\n";
+  // Parallel (and cached) replacement for visiting MethodDeclList; defined
+  // after MethodDeclAST.
+  void analyzeExit(AnalyzeWalker& w);
+  void printStep(PrintWalker& w, int indent) {
+    w.indent(indent); w.text("package "); w.text(Name.str()); w.text(" {\n");
+    w.child(FieldDeclList, indent+1);
+    w.child(MethodDeclList, indent+1);
+    w.indent(indent); w.text("}\n");
   }
 
   string str()  override  {
-    return string("Package") + "(" + Name + "," + getString(FieldDeclList) + "," + getString(MethodDeclList) + ")";
+    return string("Package") + "(" + Name.str() + "," + getString(FieldDeclList) + "," + getString(MethodDeclList) + ")";
+  }
+  void serialize(AstWriter& w) override {
+    w << "Package(" << Name << ","; writeString(w, FieldDeclList);
+    w << ","; writeString(w, MethodDeclList); w << ")";
   }
 };
 
@@ -192,68 +595,84 @@ class ProgramAST : public decafAST {
   decafStmtList *ExternList;
   PackageAST *PackageDef;
 public:
+   explicit ProgramAST(AstLoadTag) : decafAST(ASTKind::ProgramAST) {}
+   template <class F> void fields(F &f) { f(ExternList); f(PackageDef); }
    ProgramAST(decafStmtList *externs, PackageAST *c, int l)
-        : decafAST(l), ExternList(externs), PackageDef(c) {}
-  ~ProgramAST() {
-    delete ExternList;
-    delete PackageDef;
+        : decafAST(ASTKind::ProgramAST, l), ExternList(externs), PackageDef(c) {}
+   decafStmtList* getExterns() const { return ExternList; }
+   PackageAST* getPackage() const { return PackageDef; }
+  void analyzeStep(AnalyzeWalker& w) {
+    w.pushScope();
+    w.child(ExternList);
+    w.child(PackageDef);
+    w.popScope();
+    w.exit(this);
   }
-  void Analyze() override {
-    gSym.push();
-    if (ExternList) ExternList->Analyze();
-    if (PackageDef) PackageDef->Analyze();
-    gSym.pop();
+  void analyzeExit(AnalyzeWalker& w) {
+    w.diag.flush();
   }
-  void prettyPrint(std::ostream& out, int indent = 0) override {
-    if (ExternList) ExternList->prettyPrint(out, indent);
-    if (PackageDef) PackageDef->prettyPrint(out, indent);
+  void printStep(PrintWalker& w, int indent) {
+    w.child(ExternList, indent);
+    w.child(PackageDef, indent);
   }
 
   string str()  override  { return string("Program") + "(" + getString(ExternList) + "," + getString(PackageDef) + ")"; }
+  void serialize(AstWriter& w) override {
+    w << "Program("; writeString(w, ExternList);
+    w << ","; writeString(w, PackageDef); w << ")";
+  }
 };
 
 
 
 class FieldDeclAST : public decafAST {
-    std::string Name;
+    Ident       Name;
     decafAST   *Type;
     int         len;           
 
+protected:
+    // The same constructors for a subclass, which is counted as kind `k`.
+    FieldDeclAST(ASTKind k, AstLoadTag) : decafAST(k) {}
+    FieldDeclAST(ASTKind k, Ident n, decafAST *t, int l)
+        : decafAST(k, l), Name(n), Type(t), len(-1) {}
+    FieldDeclAST(ASTKind k, Ident n, decafAST *t, int size, int l)
+        : decafAST(k, l), Name(n), Type(t), len(size) {}
+
 public:
+    explicit FieldDeclAST(AstLoadTag tag) : FieldDeclAST(ASTKind::FieldDeclAST, tag) {}
+    template <class F> void fields(F &f) { f(Name); f(Type); f(len); }
     
-    FieldDeclAST(const std::string& n,
+    FieldDeclAST(Ident n,
                  decafAST*          t,
                  int                l)          
-        : decafAST(l), Name(n), Type(t), len(-1) {}
+        : FieldDeclAST(ASTKind::FieldDeclAST, n, t, l) {}
 
   
-    FieldDeclAST(const std::string& n,
+    FieldDeclAST(Ident n,
                  decafAST*          t,
                  int                size,       
                  int                l)         
-        : decafAST(l), Name(n), Type(t), len(size) {}
-
-    ~FieldDeclAST() { delete Type; }
-    void Analyze() override {
-        DecafType dtype = TYPE_UNKNOWN;
-        if (dynamic_cast<IntTypeAST*>(Type)) dtype = TYPE_INT;
-        else if (dynamic_cast<BoolTypeAST*>(Type)) dtype = TYPE_BOOL;
-        else if (dynamic_cast<StringTypeAST*>(Type)) dtype = TYPE_STRING;
-        else if (dynamic_cast<VoidTypeAST*>(Type)) dtype = TYPE_VOID;
-        if (!gSym.insert(Name, dtype, getLine())) {
-            std::cerr << "Error: field '" << Name << "' redeclared (line " << getLine() << ")\n";
+        : FieldDeclAST(ASTKind::FieldDeclAST, n, t, size, l) {}
+
+    Ident getName() const { return Name; }
+    decafAST* getType() const { return Type; }
+    // Element count, or -1 for a scalar.
+    int getLength() const { return len; }
+
+    void analyzeStep(AnalyzeWalker& w) {
+        DecafType dtype = astToType(Type);
+        if (!w.sym.insert(Name, dtype, getLine(), this)) {
+            w.diag.redeclared("field", Name, getLine());
         } else {                                    
-        std::cerr << "defined variable: " << Name
-                  << ", with type: "  << typeToString(dtype)
-                  << ", on line number: " << getLine() << '\n';
+        w.diag.defined(Name, dtype, getLine());
         }
     }
     
-    void prettyPrint(std::ostream& out, int indent = 0) override {
-      printIndent(out, indent);
-      out << "var " << Name << " ";
-      if (Type) Type->prettyPrint(out, 0);
-      out << ";\n";
+    void printStep(PrintWalker& w, int indent) {
+      w.indent(indent);
+      w.text("var "); w.text(Name.str()); w.text(" ");
+      w.child(Type, 0);
+      w.text(";\n");
     }
 
 
@@ -261,34 +680,45 @@ public:
         const std::string tail =
             (len < 0 ? "Scalar"
                      : "Array(" + std::to_string(len) + ")");
-        return "FieldDecl(" + Name + "," + getString(Type) + "," + tail + ")";
+        return "FieldDecl(" + Name.str() + "," + getString(Type) + "," + tail + ")";
+    }
+    void serialize(AstWriter& w) override {
+        w << "FieldDecl("; serializeFields(w);
+    }
+
+    // Everything after "FieldDecl(", shared with ArrayFieldDeclAST.
+    void serializeFields(AstWriter& w) {
+        w << Name << ","; writeString(w, Type);
+        if (len < 0) w << ",Scalar)";
+        else         w << ",Array(" << len << "))";
     }
 };
 
 
 class FieldDeclArrayAST : public decafAST {
-    std::string Name;
+    Ident       Name;
     decafAST   *Type;
     int         Size;
 public:
-    FieldDeclArrayAST(const std::string& n,
+    explicit FieldDeclArrayAST(AstLoadTag) : decafAST(ASTKind::FieldDeclArrayAST) {}
+    template <class F> void fields(F &f) { f(Name); f(Type); f(Size); }
+    FieldDeclArrayAST(Ident n,
                       decafAST*          t,
                       int                sz,
                       int                l)             
-        : decafAST(l), Name(n), Type(t), Size(sz) {}
+        : decafAST(ASTKind::FieldDeclArrayAST, l), Name(n), Type(t), Size(sz) {}
+    Ident getName() const { return Name; }
+    decafAST* getType() const { return Type; }
+    int getSize() const { return Size; }
 
-    ~FieldDeclArrayAST() { delete Type; }
 
-    void Analyze() override {
-        DecafType dtype = TYPE_UNKNOWN;
-        if (dynamic_cast<IntTypeAST*>(Type)) dtype = TYPE_INT;
-        else if (dynamic_cast<BoolTypeAST*>(Type)) dtype = TYPE_BOOL;
-        if (!gSym.insert(Name, dtype, getLine())) {
-            std::cerr << "Error: array field '" << Name << "' redeclared (line " << getLine() << ")\n";
+    void analyzeStep(AnalyzeWalker& w) {
+        DecafType dtype = astToType(Type);
+        if (dtype != TYPE_INT && dtype != TYPE_BOOL) dtype = TYPE_UNKNOWN;
+        if (!w.sym.insert(Name, dtype, getLine(), this)) {
+            w.diag.redeclared("array field", Name, getLine());
         } else {                                    
-        std::cerr << "defined variable: " << Name
-                  << ", with type: "  << typeToString(dtype)
-                  << ", on line number: " << getLine() << '\n';
+        w.diag.defined(Name, dtype, getLine());
        }
     }
 
@@ -298,122 +728,168 @@ public:
            << ",Array(" << Size << "))";
         return os.str();
     }
+    void serialize(AstWriter& w) override {
+        w << "FieldDecl(" << Name << ","; writeString(w, Type);
+        w << ",Array(" << Size << "))";
+    }
 };
 
 
 class ArrayLocExprAST : public decafAST {
-    std::string name;  decafAST *index;   int declLine = -1;      
+    Ident name;  decafAST *index;   DeclId decl = NoDecl;
 public:
-    ArrayLocExprAST(const std::string& n, decafAST* idx, int l) : decafAST(l), name(n), index(idx) {}
-    ~ArrayLocExprAST() { delete index; }
-    void Analyze() override {
-      if (auto *sym = gSym.lookup(name)) {
-            declLine = sym->lineDeclared;     
-        } else {
-          std::cerr << "Error: array variable '" << name << "' not declared (line " << getLine() << ")\n";
+    explicit ArrayLocExprAST(AstLoadTag) : decafAST(ASTKind::ArrayLocExprAST) {}
+    template <class F> void fields(F &f) { f(name); f(index); }
+    ArrayLocExprAST(Ident n, decafAST* idx, int l) : decafAST(ASTKind::ArrayLocExprAST, l), name(n), index(idx) {}
+    Ident getName() const { return name; }
+    decafAST* getIndex() const { return index; }
+    DeclId getDecl() const { return decl; }
+    DeclId* declSlot() { return &decl; }
+    void analyzeStep(AnalyzeWalker& w) {
+      if (SymDescriptor *d = w.sym.lookup(name, decl)) {
+          setExprType(d->type);
+      } else {
+          w.diag.undeclared("array variable", name, getLine());
       }
-      if (index) index->Analyze();
+      w.child(index);
+      if (gOptions.typeCheck) w.exit(this);
+    }
+    void analyzeExit(AnalyzeWalker& w) {
+      w.expect(index, TYPE_INT, "index of", name, getLine());
     }
 
     std::string str()  override  {
-        return "ArrayLocExpr(" + name + "," + getString(index) + ")";
+        return "ArrayLocExpr(" + name.str() + "," + getString(index) + ")";
+    }
+    void serialize(AstWriter& w) override {
+        w << "ArrayLocExpr(" << name << ","; writeString(w, index); w << ")";
     }
 };
 
 
 class AssignArrayLocAST : public decafAST {
-    std::string name;  decafAST *index;  decafAST *expr;   int declLine = -1;      
+    Ident name;  decafAST *index;  decafAST *expr;   DeclId decl = NoDecl;
 public:
-    AssignArrayLocAST(const std::string& n, decafAST* idx, decafAST* e, int l) : decafAST(l), name(n), index(idx), expr(e) {}
-    ~AssignArrayLocAST() { delete index; delete expr; }
-    void Analyze() override {
-        if (auto *sym = gSym.lookup(name)) {
-            declLine = sym->lineDeclared;     
-        } else {
-            std::cerr << "Error: array '" << name << "' not declared (line " << getLine() << ")\n";
+    explicit AssignArrayLocAST(AstLoadTag) : decafAST(ASTKind::AssignArrayLocAST) {}
+    template <class F> void fields(F &f) { f(name); f(index); f(expr); }
+    AssignArrayLocAST(Ident n, decafAST* idx, decafAST* e, int l) : decafAST(ASTKind::AssignArrayLocAST, l), name(n), index(idx), expr(e) {}
+    Ident getName() const { return name; }
+    decafAST* getIndex() const { return index; }
+    decafAST* getExpr() const { return expr; }
+    DeclId getDecl() const { return decl; }
+    DeclId* declSlot() { return &decl; }
+    void analyzeStep(AnalyzeWalker& w) {
+        if (!w.sym.lookup(name, decl)) {
+            w.diag.undeclared("array", name, getLine());
         }
-        if (index) index->Analyze();
-        if (expr) expr->Analyze();
+        w.child(index);
+        w.child(expr);
+        if (gOptions.typeCheck) w.exit(this);
+    }
+    void analyzeExit(AnalyzeWalker& w) {
+        w.expect(index, TYPE_INT, "index of", name, getLine());
+        if (const DeclInfo *d = w.sym.declInfo(decl))
+            w.expect(expr, d->type, "value assigned to", name, getLine());
     }
 
-    void prettyPrint(std::ostream& out, int indent = 0) override {
-      printIndent(out, indent);
-      out << name << "[";
-      if (index) index->prettyPrint(out, 0);
-      out << "] = ";
-      if (expr) expr->prettyPrint(out, 0);
-      out << ";\n";
+    void printStep(PrintWalker& w, int indent) {
+      w.indent(indent);
+      w.text(name.str()); w.text("[");
+      w.child(index, 0);
+      w.text("] = ");
+      w.child(expr, 0);
+      w.text(";\n");
     }
 
     std::string str()  override {
-        return "AssignArrayLoc(" + name + "," +
+        return "AssignArrayLoc(" + name.str() + "," +
                getString(index) + "," + getString(expr) + ")";
     }
+    void serialize(AstWriter& w) override {
+        w << "AssignArrayLoc(" << name << ","; writeString(w, index);
+        w << ","; writeString(w, expr); w << ")";
+    }
 };
 
 class ArrayFieldDeclAST : public FieldDeclAST {
 public:
-    using FieldDeclAST::FieldDeclAST;   
+    template <class... Args>
+    ArrayFieldDeclAST(Args&&... args)
+        : FieldDeclAST(ASTKind::ArrayFieldDeclAST, std::forward<Args>(args)...) {}
     std::string str()  override  {                
         return "ArrayFieldDecl" + FieldDeclAST::str().substr(10);
     }
+    void serialize(AstWriter& w) override {
+        w << "ArrayFieldDecl"; serializeFields(w);
+    }
 };
 
 
 class VariableAST : public decafAST {
-    std::string Name;
-    int declLine = -1;          
+    Ident Name;
+    DeclId decl = NoDecl;
 public:
-    explicit VariableAST(const std::string& name, int l = -1)
-        : decafAST(l), Name(name) {}
-
-    const std::string& getName() const { return Name; }
-    int getDeclLine()  const { return declLine; }   
-
-    void Analyze() override {
-        if (auto *sym = gSym.lookup(Name)) {
-            declLine = sym->lineDeclared;     
+    explicit VariableAST(AstLoadTag) : decafAST(ASTKind::VariableAST) {}
+    template <class F> void fields(F &f) { f(Name); }
+    explicit VariableAST(Ident name, int l = -1)
+        : decafAST(ASTKind::VariableAST, l), Name(name) {}
+
+    Ident getName() const { return Name; }
+    DeclId getDecl() const { return decl; }
+    DeclId* declSlot() { return &decl; }
+
+    void analyzeStep(AnalyzeWalker& w) {
+        if (SymDescriptor *d = w.sym.lookup(Name, decl)) {
+            setExprType(d->type);
         } else {
-            std::cerr << "Error: variable '" << Name
-                      << "' not declared (line " << getLine() << ")\n";
+            w.diag.undeclared("variable", Name, getLine());
         }
     }
 
-    void prettyPrint(std::ostream& out, int /*indent*/ = 0) override {
-        out << Name;
+    void printStep(PrintWalker& w, int /*indent*/) {
+        w.text(Name.str());
     }
 
-    std::string str() override { return "VariableExpr(" + Name + ")"; }
+    std::string str() override { return "VariableExpr(" + Name.str() + ")"; }
+    void serialize(AstWriter& w) override { w << "VariableExpr(" << Name << ")"; }
 };
 
 
 class AssignAST : public decafAST {
-    std::string Name;
+    Ident       Name;
     decafAST   *Expr;
-    int declLine = -1;            
+    DeclId decl = NoDecl;
+    static Ident lvalName(decafAST *lval) {
+        auto *v = dyn_cast<VariableAST>(lval);
+        return v ? v->getName() : Ident("");
+    }
 public:
+    explicit AssignAST(AstLoadTag) : decafAST(ASTKind::AssignAST) {}
+    template <class F> void fields(F &f) { f(Name); f(Expr); }
     AssignAST(decafAST *lval, decafAST *expr, int l)
-        : decafAST(l), Expr(expr) {
-        auto *v = dynamic_cast<VariableAST*>(lval);
-        Name = v ? v->getName() : "";
-        delete lval;
-    }
-    ~AssignAST() override { delete Expr; }
+        : decafAST(ASTKind::AssignAST, l), Name(lvalName(lval)), Expr(expr) {}
     
-    void Analyze() override {
-        if (auto *sym = gSym.lookup(Name))
-            declLine = sym->lineDeclared;
-        else
-            std::cerr << "Error: variable '" << Name
-                      << "' not declared (line " << getLine() << ")\n";
-        if (Expr) Expr->Analyze();
+    void analyzeStep(AnalyzeWalker& w) {
+        if (!w.sym.lookup(Name, decl))
+            w.diag.undeclared("variable", Name, getLine());
+        w.child(Expr);
+        if (gOptions.typeCheck) w.exit(this);
     }
+    void analyzeExit(AnalyzeWalker& w) {
+        if (const DeclInfo *d = w.sym.declInfo(decl))
+            w.expect(Expr, d->type, "value assigned to", Name, getLine());
+    }
+
+    Ident getName() const { return Name; }
+    decafAST* getExpr() const { return Expr; }
+    DeclId getDecl() const { return decl; }
+    DeclId* declSlot() { return &decl; }
 
-    void prettyPrint(std::ostream& out, int indent = 0) override {
-        printIndent(out, indent);
-        out << Name << " = ";
-        if (Expr) Expr->prettyPrint(out, 0);
-        out << "; // using decl on line: " << declLine << "\n\n";
+    void printStep(PrintWalker& w, int indent) {
+        w.indent(indent);
+        w.text(Name.str()); w.text(" = ");
+        w.child(Expr, 0);
+        w.text("; // using decl on line: "); w.number(declLineOf(decl)); w.text("\n\n");
     }
 };
 
@@ -421,28 +897,38 @@ public:
 class MethodBlockAST : public decafAST {
     decafStmtList* varList;
     decafStmtList* stmtList;
+    ScopeSnapshot  env;
 public:
+    explicit MethodBlockAST(AstLoadTag) : decafAST(ASTKind::MethodBlockAST) {}
+    template <class F> void fields(F &f) { f(varList); f(stmtList); }
     MethodBlockAST(decafStmtList* vars,
                    decafStmtList* stmts,
                    int            l)         
-        : decafAST(l),
+        : decafAST(ASTKind::MethodBlockAST, l),
           varList(vars ? vars : new decafStmtList(l)),
           stmtList(stmts ? stmts : new decafStmtList(l)) {}
+    decafStmtList* getVars() const { return varList; }
+    decafStmtList* getStmts() const { return stmtList; }
 
-    ~MethodBlockAST() { delete varList; delete stmtList; }
 
-    void Analyze() override {
-    gSym.push();
-    if (varList) varList->Analyze();
-    if (stmtList) stmtList->Analyze();
-    gSym.pop();
+    void analyzeStep(AnalyzeWalker& w) {
+    env = w.sym.snapshotFor(this);
+    w.pushScope();
+    w.child(varList);
+    w.child(stmtList);
+    w.popScope();
     }
 
-    void prettyPrint(std::ostream &out, int indent = 0) override
+    // What was visible on entry: enclosing declarations and the parameters.
+    // Empty unless the analysis kept snapshots (--scope-snapshots).
+    ScopeSnapshot entryScope() const { return env; }
+    void setEntryScope(ScopeSnapshot e) { env = e; }
+
+    void printStep(PrintWalker& w, int indent)
     {
-        if (varList)  varList->prettyPrint(out, indent);
-        if (stmtList) stmtList->prettyPrint(out, indent);
-        if (varList && stmtList && stmtList->size() > 0) out << "\n";
+        w.child(varList, indent);
+        w.child(stmtList, indent);
+        if (varList && stmtList && stmtList->size() > 0) w.text("\n");
     }
 
 
@@ -450,147 +936,203 @@ public:
         return "MethodBlock(" + getString(varList) + "," +
                               getString(stmtList) + ")";
     }
+    void serialize(AstWriter& w) override {
+        w << "MethodBlock("; writeString(w, varList);
+        w << ","; writeString(w, stmtList); w << ")";
+    }
 };
 
 
 class BlockAST : public decafAST {
   decafStmtList* varDecls;
   decafStmtList* stmts;
+  ScopeSnapshot  env;
 public:
+   explicit BlockAST(AstLoadTag) : decafAST(ASTKind::BlockAST) {}
+   template <class F> void fields(F &f) { f(varDecls); f(stmts); }
    BlockAST(decafStmtList* decls, decafStmtList* stmts, int l)
-        : decafAST(l), varDecls(decls), stmts(stmts) {}
-  ~BlockAST() {
-    delete varDecls;
-    delete stmts;
+        : decafAST(ASTKind::BlockAST, l), varDecls(decls), stmts(stmts) {}
+   decafStmtList* getVars() const { return varDecls; }
+   decafStmtList* getStmts() const { return stmts; }
+
+  void analyzeStep(AnalyzeWalker& w) {
+    env = w.sym.snapshotFor(this);
+    w.pushScope();
+    w.child(varDecls);
+    w.child(stmts);
+    w.popScope();
   }
 
-  void Analyze() override {
-    gSym.push();
-    if (varDecls) varDecls->Analyze();
-    if (stmts) stmts->Analyze();
-    gSym.pop();
-  }
+  ScopeSnapshot entryScope() const { return env; }
+  void setEntryScope(ScopeSnapshot e) { env = e; }
 
-  void prettyPrint(std::ostream& out, int indent = 0) override {
-    printIndent(out, indent); out << "{\n";
-    if (varDecls) varDecls->prettyPrint(out, indent+1);
-    if (stmts) stmts->prettyPrint(out, indent+1);
-    printIndent(out, indent); out << "}\n";
+  void printStep(PrintWalker& w, int indent) {
+    w.indent(indent); w.text("{\n");
+    w.child(varDecls, indent+1);
+    w.child(stmts, indent+1);
+    w.indent(indent); w.text("}\n");
   }
   
   string str() override  {
     return "Block(" + getString(varDecls) + "," + getString(stmts) + ")";
   }
+  void serialize(AstWriter& w) override {
+    w << "Block("; writeString(w, varDecls);
+    w << ","; writeString(w, stmts); w << ")";
+  }
 };
 
 
 class MethodDeclAST : public decafAST {
-  string Name;
+  Ident Name;
   decafStmtList *Args;
   decafAST *ReturnType;
   MethodBlockAST *Block;
 public:
-   MethodDeclAST(const std::string& name, decafStmtList *args, decafAST *rtype,
+   explicit MethodDeclAST(AstLoadTag) : decafAST(ASTKind::MethodDeclAST) {}
+   template <class F> void fields(F &f) { f(Name); f(Args); f(ReturnType); f(Block); }
+   MethodDeclAST(Ident name, decafStmtList *args, decafAST *rtype,
                   MethodBlockAST *block, int l)
-        : decafAST(l), Name(name), Args(args), ReturnType(rtype), Block(block) {}
-  ~MethodDeclAST() {
-    delete Args;
-    delete ReturnType;
-    delete Block;
-  }
+        : decafAST(ASTKind::MethodDeclAST, l), Name(name), Args(args), ReturnType(rtype), Block(block) {}
+   Ident getName() const { return Name; }
+   decafStmtList* getArgs() const { return Args; }
+   decafAST* getReturnType() const { return ReturnType; }
+   MethodBlockAST* getBlock() const { return Block; }
   
-  void Analyze() override {
+  void analyzeStep(AnalyzeWalker& w) {
+    declare(w.sym, w.diag);
+    scheduleBody(w);
+  }
+
+  // Enters the method name into the package scope.
+  void declare(SymbolStack& sym, Diagnostics& diag) {
     DecafType rtype = astToType(ReturnType);
-       if (!gSym.insert(Name, rtype, getLine())) {
-        std::cerr << "Error: method '" << Name << "' redeclared (line " << getLine() << ")\n";
+       if (!sym.insert(Name, rtype, getLine(), this)) {
+        diag.redeclared("method", Name, getLine());
     }
-    gSym.push(); 
-    if (Args) Args->Analyze();
-    if (Block) Block->Analyze();
-    gSym.pop();
   }
 
-  void prettyPrint(std::ostream& out, int indent = 0) override {
-      printIndent(out, indent + 1); 
-      out << "func " << Name << "(";
+  // Parameters and body only read the enclosing scopes, so once declare()
+  // has run this part may go to another thread with its own SymbolStack.
+  void scheduleBody(AnalyzeWalker& w) {
+    w.returnType = astToType(ReturnType);
+    w.method = Name;
+    w.pushScope(); 
+    w.child(Args);
+    w.child(Block);
+    w.popScope();
+  }
+
+  void printStep(PrintWalker& w, int indent) {
+      w.indent(indent + 1); 
+      w.text("func "); w.text(Name.str()); w.text("(");
       if (Args) {
           bool first = true;
           for (auto *arg : Args->getStmts()) {
-              if (!first) out << ", ";
-              arg->prettyPrint(out, 0);
+              if (!first) w.text(", ");
+              w.child(arg, 0);
               first = false;
           }
       }
-      out << ") ";
-      if (ReturnType) ReturnType->prettyPrint(out, 0);
-      out << " {\n";
-      if (Block) Block->prettyPrint(out, indent + 3); 
-      printIndent(out, indent + 1);
-      out << "}\n";
+      w.text(") ");
+      w.child(ReturnType, 0);
+      w.text(" {\n");
+      w.child(Block, indent + 3); 
+      w.indent(indent + 1);
+      w.text("}\n");
   }
 
 
   string str()  override {
-    return string("Method") + "(" + Name + "," + getString(ReturnType) + "," + getString(Args) + "," + getString(Block) + ")";
+    return string("Method") + "(" + Name.str() + "," + getString(ReturnType) + "," + getString(Args) + "," + getString(Block) + ")";
+  }
+  void serialize(AstWriter& w) override {
+    w << "Method(" << Name << ","; writeString(w, ReturnType);
+    w << ","; writeString(w, Args);
+    w << ","; writeString(w, Block); w << ")";
   }
 };
 
 
 class MethodCallAST : public decafAST {
-    std::string    name;
+    Ident          name;
     decafStmtList *args;
-    int declLine = -1;    
+    DeclId decl = NoDecl;
     int argLine = -1;                  
 public:
-    MethodCallAST(const std::string& n,
+    explicit MethodCallAST(AstLoadTag) : decafAST(ASTKind::MethodCallAST) {}
+    template <class F> void fields(F &f) { f(name); f(args); }
+    MethodCallAST(Ident n,
                   decafStmtList*     a,
                   int l)          
-        : decafAST(l), name(n),
+        : decafAST(ASTKind::MethodCallAST, l), name(n),
           args(a ? a : new decafStmtList(l)) {}
 
-    ~MethodCallAST() { delete args; }
-    void Analyze() override {
-        
-        if (auto *sym = gSym.lookup(name))
-            declLine = sym->lineDeclared;
+    Ident getName() const { return name; }
+    decafStmtList* getArgs() const { return args; }
+    DeclId getDecl() const { return decl; }
+    DeclId* declSlot() { return &decl; }
+    int getArgLine() const { return argLine; }
+    void setArgLine(int l) { argLine = l; }
+
+    void analyzeStep(AnalyzeWalker& w) {
+        if (SymDescriptor *d = w.sym.lookup(name, decl))
+            setExprType(d->type);
 
         if (args) {
-            args->Analyze();
+            w.child(args);
+            w.exit(this);
+        }
+    }
+
+    // Runs once the arguments have been analyzed.
+    void analyzeExit(AnalyzeWalker& w) {
             for (auto *a : args->getStmts()) {
-                if (auto *v = dynamic_cast<VariableAST*>(a)) {
-                    argLine = v->getDeclLine();
+                if (!a) continue;
+                switch (a->getKind()) {
+                case ASTKind::VariableAST:
+                    if (const DeclInfo *d = w.sym.declInfo(static_cast<VariableAST*>(a)->getDecl()))
+                        argLine = d->line;
                     break;
-                }
-                if (auto *ar = dynamic_cast<ArrayLocExprAST*>(a)) {
-                    argLine = ar->getLine();  
+                case ASTKind::ArrayLocExprAST:
+                    argLine = a->getLine();
                     break;
+                default:
+                    continue;
                 }
+                break;
             }
-        }
+            if (gOptions.typeCheck) checkArgs(w);
     }
-
-    void prettyPrint(std::ostream &out, int indent = 0) override {
-        printIndent(out, indent);
-        out << name << "(";
+    // Arguments against the parameters of the extern or method called; a
+    // bool may be passed for an int (print_int(flag)) and is widened by the
+    // code generator. Defined after ExternFunctionAST.
+    void checkArgs(AnalyzeWalker& w);
+
+    void printStep(PrintWalker& w, int indent) {
+        w.indent(indent);
+        w.text(name.str()); w.text("(");
         bool first = true;
         for (auto *a : args->getStmts()) {
-            if (!first) out << ", ";
-            a->prettyPrint(out, 0);
+            if (!first) w.text(", ");
+            w.child(a, 0);
             first = false;
         }
-        out << ") // using decl on line: "
-            << (argLine != -1 ? argLine : declLine) << "\n";
-        out << ";";
+        w.text(") // using decl on line: ");
+        w.number(argLine != -1 ? argLine : declLineOf(decl)); w.text("\n");
+        w.text(";");
     }
 };
 
 
 class ContinueStmtAST : public decafAST {
   public:
-    ContinueStmtAST(int l) : decafAST(l) {}
+    explicit ContinueStmtAST(AstLoadTag) : decafAST(ASTKind::ContinueStmtAST) {}
+    ContinueStmtAST(int l) : decafAST(ASTKind::ContinueStmtAST, l) {}
     string str()  override { return "ContinueStmt"; }
-    void prettyPrint(std::ostream& out, int indent = 0) override {
-      printIndent(out, indent); out << "continue;\n";
+    void serialize(AstWriter& w) override { w << "ContinueStmt"; }
+    void printStep(PrintWalker& w, int indent) {
+      w.indent(indent); w.text("continue;\n");
     }
 
 };
@@ -598,14 +1140,18 @@ class ContinueStmtAST : public decafAST {
 class IntConstantAST : public decafAST {
     int Value;
 public:
+    explicit IntConstantAST(AstLoadTag) : decafAST(ASTKind::IntConstantAST) {}
+    template <class F> void fields(F &f) { f(Value); }
     explicit IntConstantAST(int val, int l = -1)
-        : decafAST(l), Value(val) {}
+        : decafAST(ASTKind::IntConstantAST, l), Value(val) {}
+    int getValue() const { return Value; }
     std::string str() override {
         std::ostringstream os; os << "NumberExpr(" << Value << ")";
         return os.str();
     }
-    void prettyPrint(std::ostream& out, int indent = 0) override {
-      out << Value;
+    void serialize(AstWriter& w) override { w << "NumberExpr(" << Value << ")"; }
+    void printStep(PrintWalker& w, int indent) {
+      w.number(Value);
     }
 
 };
@@ -613,19 +1159,28 @@ public:
 class UnaryMinusAST : public decafAST {
     decafAST *Expr;
 public:
+    explicit UnaryMinusAST(AstLoadTag) : decafAST(ASTKind::UnaryMinusAST) {}
+    template <class F> void fields(F &f) { f(Expr); }
     explicit UnaryMinusAST(decafAST* e, int l)
-        : decafAST(l), Expr(e) {}
-    ~UnaryMinusAST() { delete Expr; }
-    void Analyze() override {
-      if (Expr) Expr->Analyze();
+        : decafAST(ASTKind::UnaryMinusAST, l), Expr(e) {}
+    decafAST* getExpr() const { return Expr; }
+    void analyzeStep(AnalyzeWalker& w) {
+      w.child(Expr);
+      if (gOptions.typeCheck) w.exit(this);
+    }
+    void analyzeExit(AnalyzeWalker& w) {
+      w.expect(Expr, TYPE_INT, "operand of unary '-'", getLine());
     }
     std::string str() override {
         return "UnaryExpr(UnaryMinus," + getString(Expr) + ")";
     }
+    void serialize(AstWriter& w) override {
+        w << "UnaryExpr(UnaryMinus,"; writeString(w, Expr); w << ")";
+    }
 
-    void prettyPrint(std::ostream& out, int indent = 0) override {
-      out << ("-");
-      if (Expr) Expr->prettyPrint(out, 0);
+    void printStep(PrintWalker& w, int indent) {
+      w.text("-");
+      w.child(Expr, 0);
     }
 
 };
@@ -633,27 +1188,40 @@ public:
 class NotAST : public decafAST {
     decafAST *Expr;
 public:
+    explicit NotAST(AstLoadTag) : decafAST(ASTKind::NotAST) {}
+    template <class F> void fields(F &f) { f(Expr); }
     explicit NotAST(decafAST* e, int l)
-        : decafAST(l), Expr(e) {}
-    ~NotAST() { delete Expr; }
-    void Analyze() override {
-      if (Expr) Expr->Analyze();
+        : decafAST(ASTKind::NotAST, l), Expr(e) {}
+    decafAST* getExpr() const { return Expr; }
+    void analyzeStep(AnalyzeWalker& w) {
+      w.child(Expr);
+      if (gOptions.typeCheck) w.exit(this);
+    }
+    void analyzeExit(AnalyzeWalker& w) {
+      w.expect(Expr, TYPE_BOOL, "operand of '!'", getLine());
     }
     std::string str() override {
         return "UnaryExpr(Not," + getString(Expr) + ")";
     }
-    void prettyPrint(std::ostream& out, int indent = 0) override {
-      out << ("!");
-      if (Expr) Expr->prettyPrint(out, 0);
+    void serialize(AstWriter& w) override {
+        w << "UnaryExpr(Not,"; writeString(w, Expr); w << ")";
+    }
+    void printStep(PrintWalker& w, int indent) {
+      w.text("!");
+      w.child(Expr, 0);
     }
 };
 
 class CharConstantAST : public decafAST {
     char val;
 public:
+    explicit CharConstantAST(AstLoadTag) : decafAST(ASTKind::CharConstantAST) {}
+    template <class F> void fields(F &f) { f(val); }
     explicit CharConstantAST(char v, int l = -1)
-        : decafAST(l), val(v) {}
+        : decafAST(ASTKind::CharConstantAST, l), val(v) {}
+    char getValue() const { return val; }
     std::string str() override { return "CharExpr(" + std::string(1, val) + ")"; }
+    void serialize(AstWriter& w) override { w << "CharExpr(" << val << ")"; }
 };
 
 
@@ -661,33 +1229,63 @@ public:
 class BoolExprAST : public decafAST {
     bool Val;
 public:
+    explicit BoolExprAST(AstLoadTag) : decafAST(ASTKind::BoolExprAST) {}
+    template <class F> void fields(F &f) { f(Val); }
     explicit BoolExprAST(bool v, int l = -1)
-        : decafAST(l), Val(v) {}
+        : decafAST(ASTKind::BoolExprAST, l), Val(v) {}
+    bool getValue() const { return Val; }
     std::string str() override {
         return "BoolExpr(" + std::string(Val ? "True" : "False") + ")";
     }
+    void serialize(AstWriter& w) override {
+        w << "BoolExpr(" << (Val ? "True" : "False") << ")";
+    }
 };
 
 
 class StringConstantAST : public decafAST {
-    std::string val;
+    std::string_view val;   // in gSource, or a copy held in gArena
+
+    // Text the scanner passed straight from the mapped source is used in
+    // place; anything it had to rewrite, or read from a stream, is copied.
+    static std::string_view keep(std::string_view v) {
+        if (gSource && gSource->contains(v)) {
+            DECAF_COUNT(bytesInPlace += v.size());
+            return v;
+        }
+        DECAF_COUNT(bytesCopied += v.size());
+        return gArena.copyString(v);
+    }
 public:
-    explicit StringConstantAST(const std::string& v,
+#ifdef DECAF_STATS
+    static inline thread_local uint64_t bytesInPlace = 0, bytesCopied = 0;
+#endif
+    explicit StringConstantAST(AstLoadTag) : decafAST(ASTKind::StringConstantAST) {}
+    template <class F> void fields(F &f) { f(val); }
+    explicit StringConstantAST(std::string_view v,
                                int                l = -1)   // ← add l
-        : decafAST(l), val(v) {}
+        : decafAST(ASTKind::StringConstantAST, l), val(keep(v)) {}
+    // The literal as written, quotes and escapes included.
+    std::string_view getValue() const { return val; }
 
-    std::string str() override { return "StringConstant(" + val + ")"; }
+    std::string str() override { return "StringConstant(" + std::string(val) + ")"; }
+    void serialize(AstWriter& w) override { w << "StringConstant(" << val << ")"; }
 };
 
 
 class TypeOnlyVarDefAST : public decafAST {
   decafAST *type;
 public:
-  explicit TypeOnlyVarDefAST(decafAST *t) : type(t) {}
-  ~TypeOnlyVarDefAST() { delete type; }
+  explicit TypeOnlyVarDefAST(AstLoadTag) : decafAST(ASTKind::TypeOnlyVarDefAST) {}
+  template <class F> void fields(F &f) { f(type); }
+  explicit TypeOnlyVarDefAST(decafAST *t) : decafAST(ASTKind::TypeOnlyVarDefAST), type(t) {}
+  decafAST* getType() const { return type; }
   std::string str()  override { return "VarDef(" + getString(type) + ")"; }
-  void prettyPrint(std::ostream& out, int /*indent*/ = 0) override {
-    if (type) type->prettyPrint(out, 0);
+  void serialize(AstWriter& w) override {
+    w << "VarDef("; writeString(w, type); w << ")";
+  }
+  void printStep(PrintWalker& w, int /*indent*/) {
+    w.child(type, 0);
   }
 
 };
@@ -695,93 +1293,118 @@ public:
 class BoolConstantAST : public decafAST {
     bool Value;
 public:
+    explicit BoolConstantAST(AstLoadTag) : decafAST(ASTKind::BoolConstantAST) {}
+    template <class F> void fields(F &f) { f(Value); }
     explicit BoolConstantAST(bool val, int l = -1)
-        : decafAST(l), Value(val) {}
+        : decafAST(ASTKind::BoolConstantAST, l), Value(val) {}
+    bool getValue() const { return Value; }
     std::string str() override {
         return "BoolExpr(" + std::string(Value ? "True" : "False") + ")";
     }
-    void prettyPrint(std::ostream& out, int indent = 0) override {
-      out << (Value ? "true" : "false");
+    void serialize(AstWriter& w) override {
+        w << "BoolExpr(" << (Value ? "True" : "False") << ")";
+    }
+    void printStep(PrintWalker& w, int indent) {
+      w.text(Value ? "true" : "false");
     }
 
 };
 
 class AssignGlobalVarAST : public decafAST {
-    std::string name;
+    Ident       name;
     decafAST   *type;
     decafAST   *init;
 public:
-    AssignGlobalVarAST(const std::string& id,
+    explicit AssignGlobalVarAST(AstLoadTag) : decafAST(ASTKind::AssignGlobalVarAST) {}
+    template <class F> void fields(F &f) { f(name); f(type); f(init); }
+    AssignGlobalVarAST(Ident id,
                        decafAST*          t,
                        decafAST*          val,
                        int                l)
-        : decafAST(l), name(id), type(t), init(val) {}
-    ~AssignGlobalVarAST() { delete type; delete init; }
-
-    void Analyze() override {
-        DecafType dtype = TYPE_UNKNOWN;
-        if (dynamic_cast<IntTypeAST*>(type)) dtype = TYPE_INT;
-        else if (dynamic_cast<BoolTypeAST*>(type)) dtype = TYPE_BOOL;
-        if (!gSym.insert(name, dtype, getLine())) {
-            std::cerr << "Error: global variable '" << name << "' redeclared (line " << getLine() << ")\n";
+        : decafAST(ASTKind::AssignGlobalVarAST, l), name(id), type(t), init(val) {}
+    Ident getName() const { return name; }
+    decafAST* getType() const { return type; }
+    decafAST* getInit() const { return init; }
+
+    void analyzeStep(AnalyzeWalker& w) {
+        DecafType dtype = astToType(type);
+        if (dtype != TYPE_INT && dtype != TYPE_BOOL) dtype = TYPE_UNKNOWN;
+        if (!w.sym.insert(name, dtype, getLine(), this)) {
+            w.diag.redeclared("global variable", name, getLine());
         } else {                                    
-            std::cerr << "defined variable: " << name
-                      << ", with type: "  << typeToString(dtype)
-                      << ", on line number: " << getLine() << '\n';
+            w.diag.defined(name, dtype, getLine());
         }
-        if (init) init->Analyze();
+        w.child(init);
+        if (gOptions.typeCheck) w.exit(this);
+    }
+    void analyzeExit(AnalyzeWalker& w) {
+        w.expect(init, astToType(type), "initial value of", name, getLine());
     }
 
-    void prettyPrint(std::ostream& out,int indent=0) override{
-        printIndent(out,indent);
-        out<<"var "<<name<<" ";
-        if(type)  type->prettyPrint(out,0);
-        out<<" = ";
-        if(init)  init->prettyPrint(out,0);
-        out<<";\n";
+    void printStep(PrintWalker& w,int indent){
+        w.indent(indent);
+        w.text("var "); w.text(name.str()); w.text(" ");
+        w.child(type,0);
+        w.text(" = ");
+        w.child(init,0);
+        w.text(";\n");
     }
 
     std::string str() override {
-        return "AssignGlobalVar(" + name + "," +
+        return "AssignGlobalVar(" + name.str() + "," +
                getString(type) + "," + getString(init) + ")";
     }
+    void serialize(AstWriter& w) override {
+        w << "AssignGlobalVar(" << name << ","; writeString(w, type);
+        w << ","; writeString(w, init); w << ")";
+    }
 };
 
 class WhileStmtAST : public decafAST {
   decafAST *cond;
   decafAST *stmt;
 public:
+     explicit WhileStmtAST(AstLoadTag) : decafAST(ASTKind::WhileStmtAST) {}
+     template <class F> void fields(F &f) { f(cond); f(stmt); }
      WhileStmtAST(decafAST *c, decafAST *s, int l)
-        : decafAST(l), cond(c), stmt(s) {}
-  ~WhileStmtAST() {
-    delete cond;
-    delete stmt;
+        : decafAST(ASTKind::WhileStmtAST, l), cond(c), stmt(s) {}
+     decafAST* getCond() const { return cond; }
+     decafAST* getBody() const { return stmt; }
+
+  void analyzeStep(AnalyzeWalker& w) {
+    w.pushScope();
+    w.child(cond);
+    if (gOptions.typeCheck) w.exit(this);
+    w.child(stmt);
+    w.popScope();
   }
-
-  void Analyze() override {
-    gSym.push();
-    if (cond) cond->Analyze();
-    if (stmt) stmt->Analyze();
-    gSym.pop();
+  void analyzeExit(AnalyzeWalker& w) {
+    w.expect(cond, TYPE_BOOL, "condition of 'while'", getLine());
   }
   string str()  override {
     return "WhileStmt(" + getString(cond) + "," + getString(stmt) + ")";
   }
-  void prettyPrint(std::ostream& out, int indent = 0) override {
-    printIndent(out, indent); out << "while (";
-    if (cond) cond->prettyPrint(out, 0);
-    out << ") ";
-    if (stmt) stmt->prettyPrint(out, indent);
+  void serialize(AstWriter& w) override {
+    w << "WhileStmt("; writeString(w, cond);
+    w << ","; writeString(w, stmt); w << ")";
+  }
+  void printStep(PrintWalker& w, int indent) {
+    w.indent(indent); w.text("while (");
+    w.child(cond, 0);
+    w.text(") ");
+    w.child(stmt, indent);
   }
 
 };
 
 class BreakStmtAST : public decafAST {
 public:
-  BreakStmtAST(int l) : decafAST(l) {}
+  explicit BreakStmtAST(AstLoadTag) : decafAST(ASTKind::BreakStmtAST) {}
+  BreakStmtAST(int l) : decafAST(ASTKind::BreakStmtAST, l) {}
   string str() override  { return "BreakStmt"; }
-  void prettyPrint(std::ostream& out, int indent = 0) override {
-    printIndent(out, indent); out << "break;\n";
+  void serialize(AstWriter& w) override { w << "BreakStmt"; }
+  void printStep(PrintWalker& w, int indent) {
+    w.indent(indent); w.text("break;\n");
   }
 
 };
@@ -789,30 +1412,39 @@ public:
 class IfStmtAST : public decafAST {
   decafAST *cond, *thenBlk, *elseBlk;
 public:
+   explicit IfStmtAST(AstLoadTag) : decafAST(ASTKind::IfStmtAST) {}
+   template <class F> void fields(F &f) { f(cond); f(thenBlk); f(elseBlk); }
    IfStmtAST(decafAST *c, decafAST *t, decafAST *e, int l)
-        : decafAST(l), cond(c), thenBlk(t), elseBlk(e) {}
-  ~IfStmtAST() {
-    delete cond;
-    delete thenBlk;
-    delete elseBlk;
+        : decafAST(ASTKind::IfStmtAST, l), cond(c), thenBlk(t), elseBlk(e) {}
+   decafAST* getCond() const { return cond; }
+   decafAST* getThen() const { return thenBlk; }
+   decafAST* getElse() const { return elseBlk; }
+  void analyzeStep(AnalyzeWalker& w) {
+    w.child(cond);
+    if (gOptions.typeCheck) w.exit(this);
+    w.child(thenBlk);
+    w.child(elseBlk);
   }
-  void Analyze() override {
-    if (cond) cond->Analyze();
-    if (thenBlk) thenBlk->Analyze();
-    if (elseBlk) elseBlk->Analyze();
+  void analyzeExit(AnalyzeWalker& w) {
+    w.expect(cond, TYPE_BOOL, "condition of 'if'", getLine());
   }
   string str() override  {
     return "IfStmt(" + getString(cond) + "," + getString(thenBlk) + "," + getString(elseBlk) + ")";
   }
+  void serialize(AstWriter& w) override {
+    w << "IfStmt("; writeString(w, cond);
+    w << ","; writeString(w, thenBlk);
+    w << ","; writeString(w, elseBlk); w << ")";
+  }
 
-  void prettyPrint(std::ostream& out, int indent = 0) override {
-    printIndent(out, indent); out << "if ("; 
-    if (cond) cond->prettyPrint(out, 0);
-    out << ") ";
-    if (thenBlk) thenBlk->prettyPrint(out, indent);
+  void printStep(PrintWalker& w, int indent) {
+    w.indent(indent); w.text("if ("); 
+    w.child(cond, 0);
+    w.text(") ");
+    w.child(thenBlk, indent);
     if (elseBlk) {
-        printIndent(out, indent); out << "else ";
-        elseBlk->prettyPrint(out, indent);
+        w.indent(indent); w.text("else ");
+        w.child(elseBlk, indent);
     }
   } 
 };
@@ -820,100 +1452,120 @@ public:
 class ReturnStmtAST : public decafAST {
   decafAST *value;
 public:
-  ReturnStmtAST(decafAST *v, int l) : decafAST(l), value(v) {}
-  ~ReturnStmtAST() { delete value; }
-  void Analyze() override {
-    if (value) value->Analyze();
+  explicit ReturnStmtAST(AstLoadTag) : decafAST(ASTKind::ReturnStmtAST) {}
+  template <class F> void fields(F &f) { f(value); }
+  ReturnStmtAST(decafAST *v, int l) : decafAST(ASTKind::ReturnStmtAST, l), value(v) {}
+  decafAST* getValue() const { return value; }
+  void analyzeStep(AnalyzeWalker& w) {
+    w.child(value);
+    if (value && gOptions.typeCheck) w.exit(this);
+  }
+  void analyzeExit(AnalyzeWalker& w) {
+    w.expect(value, w.returnType, "return value of", w.method, getLine());
   }
   string str() override  { return "ReturnStmt(" + getString(value) + ")"; }
+  void serialize(AstWriter& w) override {
+    w << "ReturnStmt("; writeString(w, value); w << ")";
+  }
 
-  void prettyPrint(std::ostream& out, int indent = 0) override {
-    printIndent(out, indent); out << "return";
+  void printStep(PrintWalker& w, int indent) {
+    w.indent(indent); w.text("return");
     if (value) {
-        out << " "; value->prettyPrint(out, 0);
+        w.text(" "); w.child(value, 0);
     }
-    out << ";\n";
+    w.text(";\n");
   }
 
 };
 
 class ExternFunctionAST : public decafAST {
-    std::string    name;
+    Ident          name;
     decafAST      *rettype;
     decafStmtList *params;
 public:
-    ExternFunctionAST(const std::string& n,     
+    explicit ExternFunctionAST(AstLoadTag) : decafAST(ASTKind::ExternFunctionAST) {}
+    template <class F> void fields(F &f) { f(name); f(rettype); f(params); }
+    ExternFunctionAST(Ident n,     
                       decafAST*          rtype,
                       decafStmtList*     p,
                       int                l)
-        : decafAST(l), name(n), rettype(rtype), params(p) {}
+        : decafAST(ASTKind::ExternFunctionAST, l), name(n), rettype(rtype), params(p) {}
+    Ident getName() const { return name; }
+    decafAST* getReturnType() const { return rettype; }
+    decafStmtList* getParams() const { return params; }
 
-    ~ExternFunctionAST() { delete rettype; delete params; }
 
-    void Analyze() override {
+    void analyzeStep(AnalyzeWalker& w) {
       DecafType rtype = astToType(rettype);
-      if (!gSym.insert(name, rtype, getLine())) {
-          std::cerr << "Error: extern function '" << name << "' redeclared (line " << getLine() << ")\n";
+      if (!w.sym.insert(name, rtype, getLine(), this)) {
+          w.diag.redeclared("extern function", name, getLine());
       }
-      if (params) params->Analyze(); 
+      w.child(params); 
     }
 
-    void prettyPrint(std::ostream& out, int indent = 0) override {
-      printIndent(out, indent);
-      out << "extern func " << name << "(";
+    void printStep(PrintWalker& w, int indent) {
+      w.indent(indent);
+      w.text("extern func "); w.text(name.str()); w.text("(");
 
       if (params) {
           bool first = true;
           for (auto *p : params->getStmts()) {
-              if (!first) out << ", ";
-              p->prettyPrint(out, 0);
+              if (!first) w.text(", ");
+              w.child(p, 0);
               first = false;
           }
       }
-      out << ") ";
-      if (rettype) rettype->prettyPrint(out, 0);
-      out << ";\n";
+      w.text(") ");
+      w.child(rettype, 0);
+      w.text(";\n");
     }
 
 
     std::string str() override {
-        return "ExternFunction(" + name + "," +
+        return "ExternFunction(" + name.str() + "," +
                getString(rettype) + "," + getString(params) + ")";
     }
+    void serialize(AstWriter& w) override {
+        w << "ExternFunction(" << name << ","; writeString(w, rettype);
+        w << ","; writeString(w, params); w << ")";
+    }
 };
 
 class VarDefAST : public decafAST {
-    std::string name;
+    Ident       name;
     decafAST   *type;
 public:
-    VarDefAST(const std::string& n, decafAST* t, int l)
-        : decafAST(l), name(n), type(t) {}
-    ~VarDefAST() { delete type; }
+    explicit VarDefAST(AstLoadTag) : decafAST(ASTKind::VarDefAST) {}
+    template <class F> void fields(F &f) { f(name); f(type); }
+    VarDefAST(Ident n, decafAST* t, int l)
+        : decafAST(ASTKind::VarDefAST, l), name(n), type(t) {}
+    Ident getName() const { return name; }
+    decafAST* getType() const { return type; }
     
-    void Analyze() override{
+    void analyzeStep(AnalyzeWalker& w) {
         DecafType dtype = astToType(type);
 
         // try to put the parameter into *current* scope
-        if (!gSym.insert(name, dtype, getLine()))     // insert looks only at top scope
+        if (!w.sym.insert(name, dtype, getLine(), this))     // insert looks only at top scope
         {
-            std::cerr << "Error: parameter '" << name
-                      << "' redeclared (line " << getLine() << ")\n";
+            w.diag.redeclared("parameter", name, getLine());
         }
 
-        // optional trace – delete if you don’t want the extra output
-        std::cerr << "defined variable: " << name
-                  << ", with type: "  << typeToString(dtype)
-                  << ", on line number: " << getLine() << '\n';
+        // optional trace – gDiag.setTraces(false) suppresses it
+        w.diag.defined(name, dtype, getLine());
     }
 
-    void prettyPrint(std::ostream& out, int /*indent*/ = 0) override {
-      out << name << " ";
-      if (type) type->prettyPrint(out, 0);
+    void printStep(PrintWalker& w, int /*indent*/) {
+      w.text(name.str()); w.text(" ");
+      w.child(type, 0);
     }
   
 
     std::string str() override {
-        return "VarDef(" + name + "," + getString(type) + ")";
+        return "VarDef(" + name.str() + "," + getString(type) + ")";
+    }
+    void serialize(AstWriter& w) override {
+        w << "VarDef(" << name << ","; writeString(w, type); w << ")";
     }
 };
 
@@ -922,56 +1574,107 @@ class ForStmtAST : public decafAST {
     decafAST *cond;
     decafAST *incr;
     decafAST *body;
+    ScopeSnapshot env;
 public:
+     explicit ForStmtAST(AstLoadTag) : decafAST(ASTKind::ForStmtAST) {}
+     template <class F> void fields(F &f) { f(init); f(cond); f(incr); f(body); }
      ForStmtAST(decafAST *i, decafAST *c, decafAST *inc, decafAST *b, int l)
-        : decafAST(l), init(i), cond(c), incr(inc), body(b) {}
-    ~ForStmtAST() {
-        if (init) delete init;
-        if (cond) delete cond;
-        if (incr) delete incr;
-        if (body) delete body;
-    }
-    void Analyze() override {
-    gSym.push();
-    if (init) init->Analyze();
-    if (cond) cond->Analyze();
-    if (incr) incr->Analyze();
-    if (body) body->Analyze();
-    gSym.pop();
+        : decafAST(ASTKind::ForStmtAST, l), init(i), cond(c), incr(inc), body(b) {}
+     decafAST* getInit() const { return init; }
+     decafAST* getCond() const { return cond; }
+     decafAST* getIncr() const { return incr; }
+     decafAST* getBody() const { return body; }
+    void analyzeStep(AnalyzeWalker& w) {
+    env = w.sym.snapshotFor(this);
+    w.pushScope();
+    w.child(init);
+    w.child(cond);
+    if (cond && gOptions.typeCheck) w.exit(this);
+    w.child(incr);
+    w.child(body);
+    w.popScope();
     } 
+    void analyzeExit(AnalyzeWalker& w) {
+    w.expect(cond, TYPE_BOOL, "condition of 'for'", getLine());
+    }
+
+    ScopeSnapshot entryScope() const { return env; }
+    void setEntryScope(ScopeSnapshot e) { env = e; }
     string str() override  {
         return "ForStmt(" + getString(init) + "," + getString(cond) + "," + getString(incr) + "," + getString(body) + ")";
     }
-    void prettyPrint(std::ostream& out, int indent = 0) override {
-      printIndent(out, indent); out << "for (";
-      if (init) init->prettyPrint(out, 0); out << "; ";
-      if (cond) cond->prettyPrint(out, 0); out << "; ";
-      if (incr) incr->prettyPrint(out, 0); out << ") ";
-      if (body) body->prettyPrint(out, indent);
+    void serialize(AstWriter& w) override {
+        w << "ForStmt("; writeString(w, init);
+        w << ","; writeString(w, cond);
+        w << ","; writeString(w, incr);
+        w << ","; writeString(w, body); w << ")";
+    }
+    void printStep(PrintWalker& w, int indent) {
+      w.indent(indent); w.text("for (");
+      w.child(init, 0); w.text("; ");
+      w.child(cond, 0); w.text("; ");
+      w.child(incr, 0); w.text(") ");
+      w.child(body, indent);
     }
 
 };
 
 
+// Operands are int for arithmetic and comparisons and bool for && and ||;
+// == and != take two ints or two bools.
+inline void checkOperands(AnalyzeWalker& w, decafAST *op, decafAST *lhs, decafAST *rhs,
+                          const char *what) {
+  DecafType want = TYPE_INT;
+  switch (op->getKind()) {
+  case ASTKind::AndAST:
+  case ASTKind::OrAST:
+    want = TYPE_BOOL;
+    break;
+  case ASTKind::EqualAST:
+  case ASTKind::NotEqualAST: {
+    DecafType l = lhs->getExprType(), r = rhs->getExprType();
+    if (l == TYPE_INT || l == TYPE_BOOL) want = l;
+    else if (r == TYPE_INT || r == TYPE_BOOL) want = r;
+    break;
+  }
+  default:
+    break;
+  }
+  w.expect(lhs, want, what, op->getLine());
+  w.expect(rhs, want, what, op->getLine());
+}
+
 #define MAKE_BINOP_CLASS(CLASSNAME, LABEL, OPSTR)                \
 class CLASSNAME : public decafAST {                              \
     decafAST *LHS, *RHS;                                         \
 public:                                                          \
     CLASSNAME(decafAST *lhs, decafAST *rhs, int l)               \
-        : decafAST(l), LHS(lhs), RHS(rhs) {}                     \
-    ~CLASSNAME() { delete LHS; delete RHS; }                     \
+        : decafAST(ASTKind::CLASSNAME, l), LHS(lhs), RHS(rhs) {} \
+    explicit CLASSNAME(AstLoadTag)                               \
+        : decafAST(ASTKind::CLASSNAME) {}                        \
+    template <class F> void fields(F &f) { f(LHS); f(RHS); }     \
+    decafAST* getLHS() const { return LHS; }                     \
+    decafAST* getRHS() const { return RHS; }                     \
     std::string str() override {                                 \
         return "BinaryExpr(" LABEL "," + getString(LHS) + ","    \
              + getString(RHS) + ")";                             \
     }                                                            \
-    void Analyze() override {                                    \
-        if (LHS) LHS->Analyze();                                 \
-        if (RHS) RHS->Analyze();                                 \
+    void serialize(AstWriter& w) override {                      \
+        w << "BinaryExpr(" LABEL ","; writeString(w, LHS);       \
+        w << ","; writeString(w, RHS); w << ")";                 \
+    }                                                            \
+    void analyzeStep(AnalyzeWalker& w) {                         \
+        w.child(LHS);                                            \
+        w.child(RHS);                                            \
+        if (gOptions.typeCheck) w.exit(this);                    \
+    }                                                            \
+    void analyzeExit(AnalyzeWalker& w) {                         \
+        checkOperands(w, this, LHS, RHS, "operand of '" OPSTR "'"); \
     }                                                            \
-    void prettyPrint(std::ostream& out, int indent = 0) override {\
-        if (LHS) LHS->prettyPrint(out, 0);                       \
-        out << " " << OPSTR << " ";                              \
-        if (RHS) RHS->prettyPrint(out, 0);                       \
+    void printStep(PrintWalker& w, int indent) {                 \
+        w.child(LHS, 0);                                         \
+        w.text(" " OPSTR " ");                                   \
+        w.child(RHS, 0);                                         \
     }                                                            \
 };
 
@@ -992,3 +1695,2303 @@ MAKE_BINOP_CLASS(NotEqualAST,    "Neq",          "!=")
 MAKE_BINOP_CLASS(AndAST,         "And",          "&&")
 MAKE_BINOP_CLASS(OrAST,          "Or",           "||")
 
+#define DECAF_BINARY_NODES(X) \
+  X(PlusAST) X(MinusAST) X(MultAST) X(DivAST) X(ModAST) X(LeftShiftAST) X(RightShiftAST) \
+  X(LessThanAST) X(GreaterThanAST) X(LessEqualAST) X(GreaterEqualAST) X(EqualAST) X(NotEqualAST) \
+  X(AndAST) X(OrAST)
+
+// Sets `params` to the parameter list of the extern or method `d` declares
+// (null when it takes none); false if `d` declares neither.
+static bool calleeParams(const DeclInfo *d, decafStmtList *&params) {
+  if (!d) return false;
+  if (auto *e = dyn_cast<ExternFunctionAST>(d->node)) params = e->getParams();
+  else if (auto *m = dyn_cast<MethodDeclAST>(d->node)) params = m->getArgs();
+  else return false;
+  return true;
+}
+
+// The declared type of an extern's `int` or a method's `a int`.
+static DecafType paramType(decafAST *p) {
+  decafAST *type = nullptr;
+  if (auto *t = dyn_cast<TypeOnlyVarDefAST>(p)) type = t->getType();
+  else if (auto *v = dyn_cast<VarDefAST>(p)) type = v->getType();
+  return astToType(type);
+}
+
+void MethodCallAST::checkArgs(AnalyzeWalker& w) {
+  decafStmtList *params;
+  if (!calleeParams(w.sym.declInfo(decl), params)) return;
+  if ((params ? params->size() : 0) != args->size()) {
+    w.diag.arguments(name, getLine());
+    return;
+  }
+  if (!params) return;
+  auto arg = args->getStmts().begin();
+  for (decafAST *p : params->getStmts()) {
+    DecafType want = paramType(p);
+    decafAST *a = *arg++;
+    if (want == TYPE_INT && a->getExprType() == TYPE_BOOL) continue;
+    w.expect(a, want, "argument to", name, getLine());
+  }
+}
+
+
+// Calls `v` with `node` downcast to its concrete class, chosen by a switch on
+// the kind tag. `v` is typically a generic lambda or an overload set, and
+// every overload must return R.
+template <class R = void, class Visitor>
+R dispatch(decafAST *node, Visitor &&v) {
+  switch (node->getKind()) {
+#define X(C) case ASTKind::C: return v(static_cast<C*>(node));
+    DECAF_AST_NODES(X)
+#undef X
+    default: break;
+  }
+  return R();
+}
+
+
+void AnalyzeWalker::drain() {
+  WalkTask t;
+  while (next(t)) {
+    switch (t.op) {
+    case WalkTask::Visit:
+      dispatch(t.node, [this](auto *n) { n->analyzeStep(*this); });
+      break;
+    case WalkTask::Exit:
+      dispatch(t.node, [this](auto *n) { n->analyzeExit(*this); });
+      break;
+    case WalkTask::PushScope: sym.push(); break;
+    case WalkTask::PopScope:  sym.pop();  break;
+    default: break;
+    }
+  }
+}
+
+void PrintWalker::run(decafAST *root, int indent) {
+  child(root, indent);
+  WalkTask t;
+  while (next(t)) {
+    switch (t.op) {
+    case WalkTask::Visit:
+      dispatch(t.node, [this, &t](auto *n) { n->printStep(*this, t.arg); });
+      break;
+    case WalkTask::Text:
+      out.write(t.text.data(), t.text.size());
+      break;
+    case WalkTask::Indent:
+      printIndent(out, t.arg);
+      break;
+    case WalkTask::Number:
+      out << t.arg;
+      break;
+    default: break;
+    }
+  }
+}
+
+// Every method is declared serially, recording how many bindings were
+// visible at that point, so each body sees exactly the methods declared up
+// to and including itself. The bodies are then analyzed concurrently against
+// the frozen package scope, each worker reusing a private SymbolStack, and
+// their diagnostics are spliced back in source order.
+// Method bodies number their declarations from here until they are spliced
+// into gDecls.
+const DeclId LocalDeclBase = DeclId(1) << 31;
+
+// The declaration slot a use node fills in, or null for any other node.
+static DeclId* useSlot(decafAST *n) {
+  switch (n->getKind()) {
+  case ASTKind::VariableAST:       return static_cast<VariableAST*>(n)->declSlot();
+  case ASTKind::AssignAST:         return static_cast<AssignAST*>(n)->declSlot();
+  case ASTKind::ArrayLocExprAST:   return static_cast<ArrayLocExprAST*>(n)->declSlot();
+  case ASTKind::AssignArrayLocAST: return static_cast<AssignArrayLocAST*>(n)->declSlot();
+  case ASTKind::MethodCallAST:     return static_cast<MethodCallAST*>(n)->declSlot();
+  default:                         return nullptr;
+  }
+}
+
+// Cache key for a method body. The method is identified by what the printer
+// writes for it plus the kind and line of every node the printer visits,
+// which `trace` receives in that order; its dependencies are the first
+// `visible` bindings of `sym`, i.e. every extern, field and method signature
+// it can see.
+static uint64_t methodKey(MethodDeclAST *m, const SymbolStack &sym, int visible,
+                          bool traces, std::vector<decafAST*> &trace) {
+  HashBuffer text;
+  {
+    std::ostream out(&text);
+    PrintWalker pw(out);
+    pw.recordVisits(&trace);
+    pw.run(m, 0);
+  }
+  Hasher h;
+  h.u64(text.value());
+  for (decafAST *n : trace) {
+    h.u64(uint64_t(n->getKind()));
+    h.u64(uint64_t(int64_t(n->getLine())));
+  }
+  h.u64(visible);
+  sym.forEachBinding(visible, [&h, &sym](const SymDescriptor &d) {
+    h.str(gNames.spelling(d.name));
+    h.u64(d.type);
+    h.u64(uint64_t(int64_t(d.lineDeclared)));
+    h.u64(d.id);
+    // checkArgs reads the callee's parameters, which the line alone does not pin
+    decafStmtList *params;
+    if (gOptions.typeCheck && calleeParams(sym.declInfo(d.id), params)) {
+      h.u64(params ? params->size() : 0);
+      if (params)
+        for (decafAST *p : params->getStmts()) h.u64(paramType(p));
+    }
+  });
+  h.u64(traces);
+  h.u64(gOptions.typeCheck);
+  return h.h;
+}
+
+// Applies a cache entry to a freshly parsed method: rebuilds the body's
+// declarations and block snapshots in `sym` (already set up as the worker
+// would be), fills in the use nodes and queues the body's diagnostics.
+// Returns false, having changed nothing, if the entry does not fit the
+// method: a use on a node that takes none, an argument line on a node that
+// is not a call, or a declaration id out of range. `outerDecls` is the
+// number of declarations outside the body.
+static bool replayMethod(const MethodCacheEntry &e, const std::vector<decafAST*> &trace,
+                         SymbolStack &sym, Diagnostics &diag, size_t outerDecls) {
+  size_t inserts = 0;
+  for (const MethodCacheEntry::Event &ev : e.events) inserts += ev.op == ScopeEvent::Insert;
+  for (const MethodCacheEntry::Use &u : e.uses) {
+    if (!useSlot(trace[u.node])) return false;
+    if (u.target == MethodCacheEntry::Local && u.id >= inserts) return false;
+    if (u.target == MethodCacheEntry::Outer && u.id >= outerDecls) return false;
+  }
+  for (const MethodCacheEntry::ArgLine &a : e.argLines)
+    if (!dyn_cast<MethodCallAST>(trace[a.node])) return false;
+
+  BindingTable *table = sym.bindingTable();
+  for (const MethodCacheEntry::Event &ev : e.events) {
+    decafAST *node = ev.node < trace.size() ? trace[ev.node] : nullptr;
+    switch (ev.op) {
+    case ScopeEvent::Push:   sym.push(); break;
+    case ScopeEvent::Pop:    sym.pop(); break;
+    case ScopeEvent::Insert: sym.insert(gNames.intern(ev.name), ev.type, ev.line, node); break;
+    case ScopeEvent::Snapshot:
+      if (auto *b = dyn_cast<MethodBlockAST>(node)) b->setEntryScope(sym.snapshot());
+      else if (auto *b = dyn_cast<BlockAST>(node)) b->setEntryScope(sym.snapshot());
+      else if (auto *b = dyn_cast<ForStmtAST>(node)) b->setEntryScope(sym.snapshot());
+      break;
+    }
+  }
+  for (const MethodCacheEntry::Use &u : e.uses) {
+    DeclId *slot = useSlot(trace[u.node]);
+    trace[u.node]->setExprType(u.type);
+    if (u.target == MethodCacheEntry::Unresolved) continue;
+    *slot = u.target == MethodCacheEntry::Local ? LocalDeclBase + u.id : u.id;
+    if (table) table->noteUse(slot);
+  }
+  for (const MethodCacheEntry::ArgLine &a : e.argLines)
+    dyn_cast<MethodCallAST>(trace[a.node])->setArgLine(a.line);
+  for (const MethodCacheEntry::Diag &d : e.diags) {
+    const char *what = d.what.empty() ? nullptr : MethodCache::whatString(d.what);
+    SymbolId name = d.name.empty() ? NoName : gNames.intern(d.name);
+    diag.replay(Diagnostic{d.kind, what, name, d.type, d.line, d.expected});
+  }
+  return true;
+}
+
+// Turns what analyzing a body produced into a cache entry. Fails if the
+// analysis reached a node the printer does not visit (array reads, for
+// one), since such a node could neither be found again nor be covered by
+// the key. Statement lists are exempt: the printer sometimes walks their
+// elements directly, and those are checked on their own.
+static bool recordMethod(const std::vector<decafAST*> &trace, const std::vector<decafAST*> &visited,
+                         const std::vector<ScopeEvent> &log, const Diagnostic *diags, size_t numDiags,
+                         MethodCacheEntry &e) {
+  std::unordered_map<decafAST*, uint32_t> index;
+  for (uint32_t k = 0; k < trace.size(); ++k) index.emplace(trace[k], k);
+  for (decafAST *n : visited)
+    if (!index.count(n) && n->getKind() != ASTKind::decafStmtList) return false;
+  e.traceSize = trace.size();
+  for (const ScopeEvent &ev : log) {
+    uint32_t node = ~0u;
+    if (ev.node) {
+      auto it = index.find(ev.node);
+      if (it == index.end()) return false;
+      node = it->second;
+    }
+    e.events.push_back(MethodCacheEntry::Event{ev.op, node,
+        ev.op == ScopeEvent::Insert ? gNames.spelling(ev.name) : std::string(), ev.type, ev.line});
+  }
+  for (decafAST *n : visited) {
+    if (n->getKind() == ASTKind::decafStmtList) continue;
+    uint32_t k = index[n];
+    if (DeclId *slot = useSlot(n)) {
+      MethodCacheEntry::Use u{k, MethodCacheEntry::Unresolved, 0, n->getExprType()};
+      if (*slot != NoDecl && *slot >= LocalDeclBase) u.target = MethodCacheEntry::Local, u.id = *slot - LocalDeclBase;
+      else if (*slot != NoDecl) u.target = MethodCacheEntry::Outer, u.id = *slot;
+      e.uses.push_back(u);
+    }
+    if (auto *c = dyn_cast<MethodCallAST>(n))
+      if (c->getArgLine() != -1) e.argLines.push_back(MethodCacheEntry::ArgLine{k, c->getArgLine()});
+  }
+  for (size_t k = 0; k < numDiags; ++k) {
+    const Diagnostic &d = diags[k];
+    e.diags.push_back(MethodCacheEntry::Diag{d.kind, d.what ? d.what : "",
+                                             gNames.spelling(d.name), d.type, d.line, d.expected});
+  }
+  return true;
+}
+
+// The pool method bodies are analyzed on, sized by gOptions.analyzeThreads
+// as it is now. Compiles running at once share it (one of them gets the
+// workers, the rest run inline); when the setting changes, the next compile
+// gets a new pool and the old one goes away with its last user.
+static std::shared_ptr<ThreadPool> analyzePool() {
+  static std::mutex lock;
+  static std::shared_ptr<ThreadPool> pool;
+  unsigned threads = gOptions.analyzeThreads ? gOptions.analyzeThreads : ThreadPool::defaultThreads();
+  std::lock_guard<std::mutex> guard(lock);
+  if (!pool || pool->size() != threads) pool = std::make_shared<ThreadPool>(threads);
+  return pool;
+}
+
+void PackageAST::analyzeExit(AnalyzeWalker& w) {
+  const StmtList &decls = MethodDeclList->getStmts();
+  size_t n = decls.size();
+  for (decafAST *d : decls) {
+    if (!dyn_cast<MethodDeclAST>(d)) {
+      // not a plain method list; fall back to the serial walk
+      w.child(MethodDeclList);
+      return;
+    }
+  }
+
+  std::deque<Diagnostics> diags;
+  std::deque<BindingTable> tables;
+  BindingTable *global = w.sym.bindingTable();
+  std::vector<int> visible(n);
+  std::vector<ScopeSnapshot> envs(n);
+  for (size_t i = 0; i < n; ++i) {
+    diags.emplace_back(w.diag.tracesEnabled());
+    tables.emplace_back(LocalDeclBase);
+    static_cast<MethodDeclAST*>(decls[i])->declare(w.sym, diags[i]);
+    visible[i] = w.sym.size();
+    envs[i] = w.sym.snapshot();
+  }
+
+  std::shared_ptr<ThreadPool> pool = analyzePool();
+  std::vector<SymbolStack> scratch(pool->size());
+  std::vector<Arena> arenas(pool->size());   // snapshot nodes, one per worker
+  if (w.sym.snapshotsEnabled())
+    for (unsigned k = 0; k < pool->size(); ++k) scratch[k].enableSnapshots(&arenas[k]);
+  auto setUp = [&](SymbolStack &local, size_t i) {
+    local.setOuter(&w.sym, visible[i], envs[i]);
+    local.setTable(global ? &tables[i] : nullptr);
+  };
+
+  // With a cache, bodies whose key has an entry are replayed here and only
+  // the rest are analyzed.
+  std::unique_ptr<MethodCache> cache;
+  std::vector<uint64_t> keys;
+  std::vector<std::vector<decafAST*>> traces, visited;
+  std::vector<std::vector<ScopeEvent>> logs;
+  std::vector<size_t> firstDiag(n);      // declare() may already have queued some
+  std::vector<size_t> todo;
+  if (!gOptions.cacheDir.empty()) {
+    cache.reset(new MethodCache(gOptions.cacheDir));
+    keys.resize(n);
+    traces.resize(n);
+    visited.resize(n);
+    logs.resize(n);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    MethodCacheEntry e;
+    if (cache) {
+      auto *m = static_cast<MethodDeclAST*>(decls[i]);
+      keys[i] = methodKey(m, w.sym, visible[i], w.diag.tracesEnabled(), traces[i]);
+      if (cache->load(keys[i], e)) {
+        if (e.traceSize == traces[i].size()) {
+          setUp(scratch[0], i);
+          if (replayMethod(e, traces[i], scratch[0], diags[i], global ? global->size() : LocalDeclBase))
+            continue;
+        }
+        cache->drop(keys[i]);   // does not fit this method; analyzed below
+      }
+    }
+    firstDiag[i] = diags[i].pending().size();
+    todo.push_back(i);
+  }
+
+  pool->parallelFor(todo.size(), [&](size_t j, unsigned worker) {
+    size_t i = todo[j];
+    SymbolStack &local = scratch[worker];
+    setUp(local, i);
+    AnalyzeWalker mw(local, diags[i]);
+    if (cache) {
+      local.setLog(&logs[i]);
+      mw.recordVisits(&visited[i]);
+    }
+    static_cast<MethodDeclAST*>(decls[i])->scheduleBody(mw);
+    mw.drain();
+    local.setLog(nullptr);
+  });
+  DECAF_COUNT(for (SymbolStack &s : scratch) w.sym.stats.add(s.stats));
+
+  // entries name local declarations by their provisional ids, so they are
+  // recorded before the tables are spliced
+  if (cache) {
+    for (size_t i : todo) {
+      MethodCacheEntry e;
+      const std::vector<Diagnostic> &queued = diags[i].pending();
+      if (recordMethod(traces[i], visited[i], logs[i], queued.data() + firstDiag[i],
+                       queued.size() - firstDiag[i], e))
+        cache->store(keys[i], e);
+    }
+  }
+
+  for (Diagnostics &d : diags) w.diag.splice(d);
+  if (global)
+    for (BindingTable &t : tables) global->splice(t);
+  for (Arena &a : arenas) gArena.adopt(a);
+}
+
+inline void decafAST::Analyze() {
+  gSym.setTable(&gDecls);
+  gSym.enableSnapshots(gOptions.scopeSnapshots ? &gArena : nullptr);
+  AnalyzeWalker w(gSym, gDiag);
+  w.run(this);
+}
+
+inline void decafAST::prettyPrint(std::ostream& out, int indent) {
+  PrintWalker w(out);
+  w.run(this, indent);
+}
+
+// ---------------------------------------------------------------------------
+// Constant folding
+
+// Rewrites constant subexpressions and algebraic identities bottom-up on the
+// usual work stack: visiting a node queues its children and then its exit,
+// and the exit replaces each child slot with the child's folded form.
+// Arithmetic wraps at 32 bits as in Decaf. Anything that traps or is
+// undefined at run time (division by zero, INT_MIN / -1, shifts outside
+// 0..31) is left for run time, and an operand is only dropped when
+// evaluating it cannot call, trap or fault.
+class FoldWalker : public TreeWalker {
+  std::unordered_set<decafAST*> effects;   // nodes whose evaluation may have effects
+
+  struct Children {
+    FoldWalker &w;
+    template <class T> void operator()(T *&n) { if (n) w.schedule(WalkTask::Visit, n); }
+    void operator()(StmtList &l) { for (decafAST *n : l) if (n) w.schedule(WalkTask::Visit, n); }
+    template <class T> void operator()(T &) {}
+  };
+  // Folds every untyped child slot; typed ones never hold expressions.
+  struct Slots {
+    FoldWalker &w;
+    bool effects = false;
+    void slot(decafAST *&n) {
+      if (!n) return;
+      n = w.fold(n);
+      effects |= w.effects.count(n) > 0;
+    }
+    void operator()(decafAST *&n) { slot(n); }
+    void operator()(StmtList &l) { for (decafAST *&n : l) slot(n); }
+    template <class T> void operator()(T &) {}
+  };
+
+  static const IntConstantAST* intConst(decafAST *n) { return dyn_cast<IntConstantAST>(n); }
+  static const BoolConstantAST* boolConst(decafAST *n) { return dyn_cast<BoolConstantAST>(n); }
+  static bool isInt(decafAST *n, int v) { auto *c = intConst(n); return c && c->getValue() == v; }
+  bool pure(decafAST *n) const { return !effects.count(n); }
+
+  decafAST* newInt(uint32_t v, decafAST *at) { ++folded; return new IntConstantAST(int32_t(v), at->getLine()); }
+  decafAST* newBool(bool v, decafAST *at) { ++folded; return new BoolConstantAST(v, at->getLine()); }
+  decafAST* keep(decafAST *n) { ++folded; return n; }
+
+  decafAST* fold(decafAST *n);
+  decafAST* foldBinary(decafAST *n, decafAST *lhs, decafAST *rhs);
+
+public:
+  size_t folded = 0;   // rewrites made
+
+  void run(decafAST *root) {
+    schedule(WalkTask::Visit, root);
+    WalkTask t;
+    while (next(t)) {
+      if (t.op == WalkTask::Visit) {
+        Children c{*this};
+        dispatch(t.node, [&c](auto *n) { n->fields(c); });
+        schedule(WalkTask::Exit, t.node);
+        continue;
+      }
+      Slots s{*this};
+      dispatch(t.node, [&s](auto *n) { n->fields(s); });
+      bool own;
+      switch (t.node->getKind()) {
+      case ASTKind::MethodCallAST:
+      case ASTKind::ArrayLocExprAST:
+        own = true;
+        break;
+      case ASTKind::DivAST:
+      case ASTKind::ModAST: {
+        // safe only when the divisor is a constant other than 0 and -1
+        decafAST *rhs = t.node->getKind() == ASTKind::DivAST ? static_cast<DivAST*>(t.node)->getRHS()
+                                                             : static_cast<ModAST*>(t.node)->getRHS();
+        auto *c = intConst(rhs);
+        own = !c || c->getValue() == 0 || c->getValue() == -1;
+        break;
+      }
+      default:
+        own = false;
+      }
+      if (own || s.effects) effects.insert(t.node);
+    }
+  }
+};
+
+decafAST* FoldWalker::fold(decafAST *n) {
+  switch (n->getKind()) {
+  case ASTKind::UnaryMinusAST: {
+    decafAST *e = static_cast<UnaryMinusAST*>(n)->getExpr();
+    if (auto *c = intConst(e)) return newInt(0u - uint32_t(c->getValue()), n);
+    if (auto *u = dyn_cast<UnaryMinusAST>(e)) return keep(u->getExpr());
+    return n;
+  }
+  case ASTKind::NotAST: {
+    decafAST *e = static_cast<NotAST*>(n)->getExpr();
+    if (auto *c = boolConst(e)) return newBool(!c->getValue(), n);
+    if (auto *u = dyn_cast<NotAST>(e)) return keep(u->getExpr());
+    return n;
+  }
+#define X(C) case ASTKind::C: return foldBinary(n, static_cast<C*>(n)->getLHS(), static_cast<C*>(n)->getRHS());
+  DECAF_BINARY_NODES(X)
+#undef X
+  default:
+    return n;
+  }
+}
+
+decafAST* FoldWalker::foldBinary(decafAST *n, decafAST *lhs, decafAST *rhs) {
+  const IntConstantAST *li = intConst(lhs), *ri = intConst(rhs);
+  const BoolConstantAST *lb = boolConst(lhs), *rb = boolConst(rhs);
+  if (li && ri) {
+    int32_t a = li->getValue(), b = ri->getValue();
+    uint32_t ua = a, ub = b;
+    bool divisible = b != 0 && !(a == INT32_MIN && b == -1);
+    bool shiftable = b >= 0 && b < 32;
+    switch (n->getKind()) {
+    case ASTKind::PlusAST:         return newInt(ua + ub, n);
+    case ASTKind::MinusAST:        return newInt(ua - ub, n);
+    case ASTKind::MultAST:         return newInt(ua * ub, n);
+    case ASTKind::DivAST:          return divisible ? newInt(a / b, n) : n;
+    case ASTKind::ModAST:          return divisible ? newInt(a % b, n) : n;
+    case ASTKind::LeftShiftAST:    return shiftable ? newInt(ua << b, n) : n;
+    case ASTKind::RightShiftAST:   return shiftable ? newInt(a >> b, n) : n;   // arithmetic
+    case ASTKind::LessThanAST:     return newBool(a < b, n);
+    case ASTKind::GreaterThanAST:  return newBool(a > b, n);
+    case ASTKind::LessEqualAST:    return newBool(a <= b, n);
+    case ASTKind::GreaterEqualAST: return newBool(a >= b, n);
+    case ASTKind::EqualAST:        return newBool(a == b, n);
+    case ASTKind::NotEqualAST:     return newBool(a != b, n);
+    default:                       return n;
+    }
+  }
+  if (lb && rb) {
+    bool a = lb->getValue(), b = rb->getValue();
+    switch (n->getKind()) {
+    case ASTKind::EqualAST:    return newBool(a == b, n);
+    case ASTKind::NotEqualAST: return newBool(a != b, n);
+    case ASTKind::AndAST:      return newBool(a && b, n);
+    case ASTKind::OrAST:       return newBool(a || b, n);
+    default:                   return n;
+    }
+  }
+  switch (n->getKind()) {
+  case ASTKind::PlusAST:
+    if (isInt(rhs, 0)) return keep(lhs);
+    if (isInt(lhs, 0)) return keep(rhs);
+    break;
+  case ASTKind::MinusAST:
+    if (isInt(rhs, 0)) return keep(lhs);
+    break;
+  case ASTKind::MultAST:
+    if (isInt(rhs, 1)) return keep(lhs);
+    if (isInt(lhs, 1)) return keep(rhs);
+    if (isInt(rhs, 0) && pure(lhs)) return newInt(0, n);
+    if (isInt(lhs, 0) && pure(rhs)) return newInt(0, n);
+    break;
+  case ASTKind::DivAST:
+    if (isInt(rhs, 1)) return keep(lhs);
+    break;
+  case ASTKind::ModAST:
+    if (isInt(rhs, 1) && pure(lhs)) return newInt(0, n);
+    break;
+  case ASTKind::LeftShiftAST:
+  case ASTKind::RightShiftAST:
+    if (isInt(rhs, 0)) return keep(lhs);
+    break;
+  case ASTKind::AndAST:
+    // the right operand is only evaluated if the left one is true
+    if (lb) return lb->getValue() ? keep(rhs) : keep(lhs);
+    if (rb && rb->getValue()) return keep(lhs);
+    if (rb && pure(lhs)) return newBool(false, n);
+    break;
+  case ASTKind::OrAST:
+    if (lb) return lb->getValue() ? keep(lhs) : keep(rhs);
+    if (rb && !rb->getValue()) return keep(lhs);
+    if (rb && pure(lhs)) return newBool(true, n);
+    break;
+  default:
+    break;
+  }
+  return n;
+}
+
+inline void decafAST::Fold() {
+  FoldWalker w;
+  w.run(this);
+}
+
+#ifdef DECAF_CODEGEN
+// ---------------------------------------------------------------------------
+// LLVM code generation
+
+// The runtime llvm-run links programs against, compiled in so --run can
+// bind their externs to it.
+extern "C" {
+#include "decaf-stdlib.c"
+}
+
+// Lowers an analyzed (and folded) program to an LLVM module. Uses find their
+// storage through the declaration the analysis resolved them to: locals are
+// allocas in the entry block, which mem2reg turns into SSA values, fields are
+// zero-initialized globals and methods are functions declared up front, so
+// calls may precede the callee. Bodies are generated on the work stack like
+// every other pass: expressions leave their value on `values`, and the
+// control flow nodes come back through Exit tasks, one per phase (`arg`),
+// with the blocks they still need kept on `blocks`.
+class CodegenWalker : public TreeWalker {
+  struct Loop {
+    llvm::BasicBlock *next, *exit;   // continue and break targets
+  };
+
+  llvm::LLVMContext &ctx;
+  llvm::Module &mod;
+  llvm::IRBuilder<> b;
+  std::ostream &err;
+  llvm::Function *fn = nullptr;                        // function being generated
+  std::unordered_map<decafAST*, llvm::Value*> storage;  // declaring node -> alloca, global or function
+  std::unordered_map<std::string, llvm::Constant*> strings;   // one global per distinct literal
+  std::vector<llvm::Value*> values;
+  std::vector<llvm::BasicBlock*> blocks;
+  std::vector<Loop> loops;
+  bool failed = false;
+
+  void error(const std::string &msg, int line) {
+    err << "Error: " << msg << " (line " << line << ")\n";
+    failed = true;
+  }
+
+  llvm::Type* typeOf(DecafType t) {
+    switch (t) {
+    case TYPE_INT:    return b.getInt32Ty();
+    case TYPE_BOOL:   return b.getInt1Ty();
+    case TYPE_STRING: return b.getInt8PtrTy();
+    default:          return b.getVoidTy();
+    }
+  }
+  llvm::Type* typeOf(decafAST *t) { return typeOf(astToType(t)); }
+
+  // Decaf passes bools where ints are expected (print_int(flag)); anything
+  // else already has the right type once analysis has accepted it.
+  llvm::Value* convert(llvm::Value *v, llvm::Type *to) {
+    if (v->getType() == to) return v;
+    if (v->getType()->isIntegerTy(1) && to->isIntegerTy(32)) return b.CreateZExt(v, to);
+    if (v->getType()->isIntegerTy(32) && to->isIntegerTy(1)) return b.CreateICmpNE(v, b.getInt32(0));
+    return llvm::UndefValue::get(to);
+  }
+
+  // Stands in for an expression that could not be generated (an error has
+  // been reported), with the type the analysis gave it.
+  llvm::Value* undefFor(decafAST *n) {
+    DecafType t = n->getExprType();
+    return llvm::UndefValue::get(t == TYPE_UNKNOWN || t == TYPE_VOID ? b.getInt32Ty() : typeOf(t));
+  }
+
+  llvm::Value* slotOf(DeclId id) {
+    if (id == NoDecl) return nullptr;
+    auto it = storage.find(gDecls[id].node);
+    return it == storage.end() ? nullptr : it->second;
+  }
+  static llvm::Type* storedType(llvm::Value *slot) {
+    if (auto *a = llvm::dyn_cast<llvm::AllocaInst>(slot)) return a->getAllocatedType();
+    return llvm::cast<llvm::GlobalVariable>(slot)->getValueType();
+  }
+  // Address of element `index` of the array a use resolved to, or null.
+  llvm::Value* element(DeclId id, llvm::Value *index, Ident name, int line) {
+    llvm::Value *slot = slotOf(id);
+    auto *g = slot ? llvm::dyn_cast<llvm::GlobalVariable>(slot) : nullptr;
+    if (!g || !g->getValueType()->isArrayTy()) {
+      error("'" + name.str() + "' is not an array", line);
+      return nullptr;
+    }
+    return b.CreateInBoundsGEP(g->getValueType(), g, {b.getInt32(0), index});
+  }
+
+  llvm::Value* pop() {
+    llvm::Value *v = values.back();
+    values.pop_back();
+    return v;
+  }
+  llvm::BasicBlock* popBlock() {
+    llvm::BasicBlock *bb = blocks.back();
+    blocks.pop_back();
+    return bb;
+  }
+  llvm::BasicBlock* newBlock(const char *name) { return llvm::BasicBlock::Create(ctx, name, fn); }
+  // Ends the current block with `br` and continues in `next`.
+  void branchTo(llvm::BasicBlock *target, llvm::BasicBlock *next) {
+    b.CreateBr(target);
+    b.SetInsertPoint(next);
+  }
+  // After a jump, whatever follows in the same statement list is dead; it
+  // still needs a block to go in.
+  void deadCode() { b.SetInsertPoint(newBlock("dead")); }
+
+  void ret(llvm::Value *v) {
+    llvm::Type *rt = fn->getReturnType();
+    if (rt->isVoidTy()) b.CreateRetVoid();
+    else b.CreateRet(v ? convert(v, rt) : llvm::Constant::getNullValue(rt));
+  }
+
+  void stmt(decafAST *n) { if (n) schedule(WalkTask::Visit, n, 0); }
+  void expr(decafAST *n) { if (n) schedule(WalkTask::Visit, n, 1); }
+  void exit(decafAST *n, int phase) { schedule(WalkTask::Exit, n, phase); }
+
+  void declareExtern(ExternFunctionAST *e);
+  void declareMethod(MethodDeclAST *m);
+  void declareGlobal(decafAST *d);
+  void defineMethod(MethodDeclAST *m);
+  void visit(decafAST *n, bool wantValue);
+  void leave(decafAST *n, int phase);
+  void call(MethodCallAST *c, bool wantValue);
+  void binary(decafAST *n, llvm::Value *l, llvm::Value *r);
+
+public:
+  CodegenWalker(llvm::Module &m, std::ostream &e)
+      : ctx(m.getContext()), mod(m), b(m.getContext()), err(e) {}
+
+  // Fills the module; false after reporting an error.
+  bool run(ProgramAST *prog);
+};
+
+void CodegenWalker::declareExtern(ExternFunctionAST *e) {
+  std::vector<llvm::Type*> params;
+  if (e->getParams())
+    for (decafAST *p : e->getParams()->getStmts())
+      if (auto *t = dyn_cast<TypeOnlyVarDefAST>(p)) params.push_back(typeOf(t->getType()));
+  auto *type = llvm::FunctionType::get(typeOf(e->getReturnType()), params, false);
+  storage[e] = mod.getOrInsertFunction(e->getName().str(), type).getCallee();
+}
+
+void CodegenWalker::declareMethod(MethodDeclAST *m) {
+  std::vector<llvm::Type*> params;
+  if (m->getArgs())
+    for (decafAST *a : m->getArgs()->getStmts())
+      if (auto *v = dyn_cast<VarDefAST>(a)) params.push_back(typeOf(v->getType()));
+  // main's value is the exit status, so a void main still returns 0
+  llvm::Type *rt = typeOf(m->getReturnType());
+  if (m->getName().str() == "main") rt = b.getInt32Ty();
+  auto *type = llvm::FunctionType::get(rt, params, false);
+  if (mod.getFunction(m->getName().str())) {
+    error("method '" + m->getName().str() + "' redefined", m->getLine());
+    return;
+  }
+  storage[m] = llvm::Function::Create(type, llvm::Function::ExternalLinkage, m->getName().str(), mod);
+}
+
+void CodegenWalker::declareGlobal(decafAST *d) {
+  Ident name;
+  llvm::Type *type = nullptr;
+  llvm::Constant *init = nullptr;
+  if (auto *f = dyn_cast<FieldDeclAST>(d)) {
+    name = f->getName();
+    type = typeOf(f->getType());
+    if (f->getLength() >= 0) type = llvm::ArrayType::get(type, f->getLength());
+  } else if (auto *f = dyn_cast<ArrayFieldDeclAST>(d)) {
+    name = f->getName();
+    type = llvm::ArrayType::get(typeOf(f->getType()), std::max(f->getLength(), 0));
+  } else if (auto *f = dyn_cast<FieldDeclArrayAST>(d)) {
+    name = f->getName();
+    type = llvm::ArrayType::get(typeOf(f->getType()), f->getSize());
+  } else if (auto *g = dyn_cast<AssignGlobalVarAST>(d)) {
+    name = g->getName();
+    type = typeOf(g->getType());
+    if (auto *c = dyn_cast<IntConstantAST>(g->getInit())) init = b.getInt32(c->getValue());
+    else if (auto *c = dyn_cast<BoolConstantAST>(g->getInit())) init = b.getInt1(c->getValue());
+    else {
+      error("initializer of '" + name.str() + "' is not a constant", d->getLine());
+      return;
+    }
+    init = llvm::cast<llvm::Constant>(convert(init, type));
+  } else {
+    return;
+  }
+  if (type->isVoidTy() || type->isPointerTy()) {
+    error("field '" + name.str() + "' has no storable type", d->getLine());
+    return;
+  }
+  if (!init) init = llvm::Constant::getNullValue(type);
+  storage[d] = new llvm::GlobalVariable(mod, type, false, llvm::GlobalValue::InternalLinkage, init, name.str());
+}
+
+bool CodegenWalker::run(ProgramAST *prog) {
+  if (prog->getExterns())
+    for (decafAST *e : prog->getExterns()->getStmts())
+      if (auto *x = dyn_cast<ExternFunctionAST>(e)) declareExtern(x);
+  PackageAST *pkg = prog->getPackage();
+  std::vector<MethodDeclAST*> methods;
+  if (pkg && pkg->getMethodDecls())
+    for (decafAST *d : pkg->getMethodDecls()->getStmts())
+      if (auto *m = dyn_cast<MethodDeclAST>(d)) {
+        declareMethod(m);
+        methods.push_back(m);
+      }
+  if (pkg && pkg->getFieldDecls())
+    for (decafAST *d : pkg->getFieldDecls()->getStmts()) declareGlobal(d);
+  for (MethodDeclAST *m : methods)
+    if (storage.count(m)) defineMethod(m);
+  return !failed;
+}
+
+void CodegenWalker::defineMethod(MethodDeclAST *m) {
+  fn = llvm::cast<llvm::Function>(storage[m]);
+  b.SetInsertPoint(newBlock("entry"));
+  if (m->getArgs()) {
+    auto arg = fn->arg_begin();
+    for (decafAST *a : m->getArgs()->getStmts()) {
+      auto *v = dyn_cast<VarDefAST>(a);
+      if (!v) continue;
+      arg->setName(v->getName().str());
+      llvm::AllocaInst *slot = b.CreateAlloca(arg->getType(), nullptr, v->getName().str());
+      b.CreateStore(&*arg, slot);
+      storage[v] = slot;
+      ++arg;
+    }
+  }
+  stmt(m->getBlock());
+  WalkTask t;
+  while (next(t)) {
+    if (t.op == WalkTask::Visit) visit(t.node, t.arg);
+    else if (t.op == WalkTask::Exit) leave(t.node, t.arg);
+  }
+  // falling off the end returns the zero value
+  for (llvm::BasicBlock &bb : *fn) {
+    if (bb.getTerminator()) continue;
+    b.SetInsertPoint(&bb);
+    ret(nullptr);
+  }
+  llvm::removeUnreachableBlocks(*fn);
+  values.clear();
+}
+
+void CodegenWalker::visit(decafAST *n, bool wantValue) {
+  switch (n->getKind()) {
+  case ASTKind::decafStmtList:
+    for (decafAST *s : static_cast<decafStmtList*>(n)->getStmts()) stmt(s);
+    break;
+  case ASTKind::MethodBlockAST:
+    stmt(static_cast<MethodBlockAST*>(n)->getVars());
+    stmt(static_cast<MethodBlockAST*>(n)->getStmts());
+    break;
+  case ASTKind::BlockAST:
+    stmt(static_cast<BlockAST*>(n)->getVars());
+    stmt(static_cast<BlockAST*>(n)->getStmts());
+    break;
+  case ASTKind::VarDeclAST: {
+    // allocated once in the entry block, zeroed wherever the block is entered
+    auto *v = static_cast<VarDeclAST*>(n);
+    llvm::Type *type = typeOf(v->getType());
+    if (type->isVoidTy()) {
+      error("variable '" + v->getName().str() + "' has no storable type", n->getLine());
+      break;
+    }
+    llvm::BasicBlock &entry = fn->getEntryBlock();
+    llvm::IRBuilder<> top(&entry, entry.begin());
+    llvm::AllocaInst *slot = top.CreateAlloca(type, nullptr, v->getName().str());
+    b.CreateStore(llvm::Constant::getNullValue(type), slot);
+    storage[v] = slot;
+    break;
+  }
+  case ASTKind::AssignAST:
+    expr(static_cast<AssignAST*>(n)->getExpr());
+    exit(n, 0);
+    break;
+  case ASTKind::AssignArrayLocAST:
+    expr(static_cast<AssignArrayLocAST*>(n)->getIndex());
+    expr(static_cast<AssignArrayLocAST*>(n)->getExpr());
+    exit(n, 0);
+    break;
+  case ASTKind::MethodCallAST:
+    for (decafAST *a : static_cast<MethodCallAST*>(n)->getArgs()->getStmts()) expr(a);
+    exit(n, wantValue);
+    break;
+  case ASTKind::IfStmtAST:
+    expr(static_cast<IfStmtAST*>(n)->getCond());
+    exit(n, 0);
+    break;
+  case ASTKind::WhileStmtAST: {
+    llvm::BasicBlock *cond = newBlock("while.cond");
+    blocks.push_back(newBlock("while.body"));
+    loops.push_back(Loop{cond, newBlock("while.end")});
+    branchTo(cond, cond);
+    expr(static_cast<WhileStmtAST*>(n)->getCond());
+    exit(n, 0);
+    break;
+  }
+  case ASTKind::ForStmtAST:
+    stmt(static_cast<ForStmtAST*>(n)->getInit());
+    exit(n, 0);
+    break;
+  case ASTKind::ReturnStmtAST:
+    expr(static_cast<ReturnStmtAST*>(n)->getValue());
+    exit(n, 0);
+    break;
+  case ASTKind::BreakStmtAST:
+  case ASTKind::ContinueStmtAST:
+    if (loops.empty()) {
+      error(n->getKind() == ASTKind::BreakStmtAST ? "break outside a loop" : "continue outside a loop",
+            n->getLine());
+      break;
+    }
+    b.CreateBr(n->getKind() == ASTKind::BreakStmtAST ? loops.back().exit : loops.back().next);
+    deadCode();
+    break;
+
+  case ASTKind::IntConstantAST:
+    values.push_back(b.getInt32(static_cast<IntConstantAST*>(n)->getValue()));
+    break;
+  case ASTKind::CharConstantAST:
+    values.push_back(b.getInt32(static_cast<CharConstantAST*>(n)->getValue()));
+    break;
+  case ASTKind::BoolConstantAST:
+    values.push_back(b.getInt1(static_cast<BoolConstantAST*>(n)->getValue()));
+    break;
+  case ASTKind::BoolExprAST:
+    values.push_back(b.getInt1(static_cast<BoolExprAST*>(n)->getValue()));
+    break;
+  case ASTKind::StringConstantAST: {
+    // the literal keeps its quotes and escapes
+    std::string_view lit = static_cast<StringConstantAST*>(n)->getValue();
+    if (lit.size() >= 2 && lit.front() == '"') lit = lit.substr(1, lit.size() - 2);
+    std::string text;
+    for (size_t i = 0; i < lit.size(); ++i) {
+      char c = lit[i];
+      if (c == '\\' && i + 1 < lit.size()) {
+        switch (c = lit[++i]) {
+        case 'n': c = '\n'; break;
+        case 't': c = '\t'; break;
+        case 'r': c = '\r'; break;
+        case 'v': c = '\v'; break;
+        case 'f': c = '\f'; break;
+        case 'a': c = '\a'; break;
+        case 'b': c = '\b'; break;
+        default:  break;      // \\, \' and \"
+        }
+      }
+      text += c;
+    }
+    llvm::Constant *&str = strings[text];
+    if (!str) str = b.CreateGlobalStringPtr(text, "str");
+    values.push_back(str);
+    break;
+  }
+  case ASTKind::VariableAST: {
+    auto *v = static_cast<VariableAST*>(n);
+    llvm::Value *slot = slotOf(v->getDecl());
+    if (!slot || llvm::isa<llvm::Function>(slot) || storedType(slot)->isArrayTy()) {
+      error("'" + v->getName().str() + "' is not a variable", n->getLine());
+      values.push_back(undefFor(n));
+      break;
+    }
+    values.push_back(b.CreateLoad(storedType(slot), slot, v->getName().str()));
+    break;
+  }
+  case ASTKind::ArrayLocExprAST:
+  case ASTKind::UnaryMinusAST:
+  case ASTKind::NotAST:
+    if (auto *a = dyn_cast<ArrayLocExprAST>(n)) expr(a->getIndex());
+    else if (auto *u = dyn_cast<UnaryMinusAST>(n)) expr(u->getExpr());
+    else expr(static_cast<NotAST*>(n)->getExpr());
+    exit(n, 0);
+    break;
+  case ASTKind::AndAST:
+    // the right operand gets its block in the exit
+    expr(static_cast<AndAST*>(n)->getLHS());
+    exit(n, 0);
+    break;
+  case ASTKind::OrAST:
+    expr(static_cast<OrAST*>(n)->getLHS());
+    exit(n, 0);
+    break;
+#define X(C) case ASTKind::C: expr(static_cast<C*>(n)->getLHS()); expr(static_cast<C*>(n)->getRHS()); exit(n, 0); break;
+  X(PlusAST) X(MinusAST) X(MultAST) X(DivAST) X(ModAST) X(LeftShiftAST) X(RightShiftAST)
+  X(LessThanAST) X(GreaterThanAST) X(LessEqualAST) X(GreaterEqualAST) X(EqualAST) X(NotEqualAST)
+#undef X
+  default:
+    break;
+  }
+}
+
+void CodegenWalker::call(MethodCallAST *c, bool wantValue) {
+  const StmtList &args = c->getArgs()->getStmts();
+  std::vector<llvm::Value*> argv(values.end() - args.size(), values.end());
+  values.resize(values.size() - args.size());
+  // a call that did not resolve may name a method declared further down
+  llvm::Value *callee = slotOf(c->getDecl());
+  auto *f = llvm::dyn_cast_or_null<llvm::Function>(callee);
+  if (!f) f = mod.getFunction(c->getName().str());
+  if (!f) {
+    error("method '" + c->getName().str() + "' not declared", c->getLine());
+  } else if (f->arg_size() != argv.size()) {
+    error("method '" + c->getName().str() + "' takes " + std::to_string(f->arg_size()) +
+          " arguments, not " + std::to_string(argv.size()), c->getLine());
+    f = nullptr;
+  }
+  if (!f) {
+    if (wantValue) values.push_back(undefFor(c));
+    return;
+  }
+  for (size_t i = 0; i < argv.size(); ++i) argv[i] = convert(argv[i], f->getArg(i)->getType());
+  llvm::Value *result = b.CreateCall(f, argv);
+  if (!wantValue) return;
+  if (f->getReturnType()->isVoidTy()) {
+    error("method '" + c->getName().str() + "' returns no value", c->getLine());
+    result = llvm::UndefValue::get(b.getInt32Ty());
+  }
+  values.push_back(result);
+}
+
+void CodegenWalker::binary(decafAST *n, llvm::Value *l, llvm::Value *r) {
+  if (l->getType() != r->getType()) {
+    l = convert(l, b.getInt32Ty());
+    r = convert(r, b.getInt32Ty());
+  }
+  llvm::Value *v;
+  switch (n->getKind()) {
+  case ASTKind::PlusAST:         v = b.CreateAdd(l, r); break;
+  case ASTKind::MinusAST:        v = b.CreateSub(l, r); break;
+  case ASTKind::MultAST:         v = b.CreateMul(l, r); break;
+  case ASTKind::DivAST:          v = b.CreateSDiv(l, r); break;
+  case ASTKind::ModAST:          v = b.CreateSRem(l, r); break;
+  case ASTKind::LeftShiftAST:    v = b.CreateShl(l, r); break;
+  case ASTKind::RightShiftAST:   v = b.CreateAShr(l, r); break;
+  case ASTKind::LessThanAST:     v = b.CreateICmpSLT(l, r); break;
+  case ASTKind::GreaterThanAST:  v = b.CreateICmpSGT(l, r); break;
+  case ASTKind::LessEqualAST:    v = b.CreateICmpSLE(l, r); break;
+  case ASTKind::GreaterEqualAST: v = b.CreateICmpSGE(l, r); break;
+  case ASTKind::EqualAST:        v = b.CreateICmpEQ(l, r); break;
+  default:                       v = b.CreateICmpNE(l, r); break;
+  }
+  values.push_back(v);
+}
+
+void CodegenWalker::leave(decafAST *n, int phase) {
+  switch (n->getKind()) {
+  case ASTKind::AssignAST: {
+    auto *a = static_cast<AssignAST*>(n);
+    llvm::Value *v = pop();
+    llvm::Value *slot = slotOf(a->getDecl());
+    if (!slot || llvm::isa<llvm::Function>(slot) || storedType(slot)->isArrayTy()) {
+      error("'" + a->getName().str() + "' is not a variable", n->getLine());
+      break;
+    }
+    b.CreateStore(convert(v, storedType(slot)), slot);
+    break;
+  }
+  case ASTKind::AssignArrayLocAST: {
+    auto *a = static_cast<AssignArrayLocAST*>(n);
+    llvm::Value *v = pop(), *index = pop();
+    if (llvm::Value *p = element(a->getDecl(), index, a->getName(), n->getLine()))
+      b.CreateStore(convert(v, storedType(slotOf(a->getDecl()))->getArrayElementType()), p);
+    break;
+  }
+  case ASTKind::ArrayLocExprAST: {
+    auto *a = static_cast<ArrayLocExprAST*>(n);
+    llvm::Value *index = pop();
+    llvm::Value *p = element(a->getDecl(), index, a->getName(), n->getLine());
+    if (p) values.push_back(b.CreateLoad(storedType(slotOf(a->getDecl()))->getArrayElementType(), p));
+    else   values.push_back(undefFor(n));
+    break;
+  }
+  case ASTKind::MethodCallAST:
+    call(static_cast<MethodCallAST*>(n), phase);
+    break;
+  case ASTKind::ReturnStmtAST:
+    ret(static_cast<ReturnStmtAST*>(n)->getValue() ? pop() : nullptr);
+    deadCode();
+    break;
+
+  case ASTKind::IfStmtAST: {
+    auto *s = static_cast<IfStmtAST*>(n);
+    if (phase == 0) {
+      llvm::Value *cond = convert(pop(), b.getInt1Ty());
+      llvm::BasicBlock *then = newBlock("if.then"), *end = newBlock("if.end");
+      llvm::BasicBlock *other = s->getElse() ? newBlock("if.else") : end;
+      b.CreateCondBr(cond, then, other);
+      b.SetInsertPoint(then);
+      blocks.push_back(end);
+      if (s->getElse()) blocks.push_back(other);
+      stmt(s->getThen());
+      exit(n, 1);
+    } else if (phase == 1 && s->getElse()) {
+      llvm::BasicBlock *other = popBlock();
+      branchTo(blocks.back(), other);
+      stmt(s->getElse());
+      exit(n, 2);
+    } else {
+      llvm::BasicBlock *end = popBlock();
+      branchTo(end, end);
+    }
+    break;
+  }
+  case ASTKind::WhileStmtAST:
+    if (phase == 0) {
+      llvm::Value *cond = convert(pop(), b.getInt1Ty());
+      llvm::BasicBlock *body = popBlock();
+      b.CreateCondBr(cond, body, loops.back().exit);
+      b.SetInsertPoint(body);
+      stmt(static_cast<WhileStmtAST*>(n)->getBody());
+      exit(n, 1);
+    } else {
+      Loop l = loops.back();
+      loops.pop_back();
+      branchTo(l.next, l.exit);
+    }
+    break;
+  case ASTKind::ForStmtAST: {
+    auto *s = static_cast<ForStmtAST*>(n);
+    switch (phase) {
+    case 0: {   // init done: test
+      llvm::BasicBlock *cond = newBlock("for.cond");
+      branchTo(cond, cond);
+      blocks.push_back(cond);
+      blocks.push_back(newBlock("for.body"));
+      loops.push_back(Loop{newBlock("for.next"), newBlock("for.end")});
+      if (s->getCond()) expr(s->getCond());
+      else values.push_back(b.getTrue());
+      exit(n, 1);
+      break;
+    }
+    case 1: {   // body
+      llvm::Value *cond = convert(pop(), b.getInt1Ty());
+      llvm::BasicBlock *body = popBlock();
+      b.CreateCondBr(cond, body, loops.back().exit);
+      b.SetInsertPoint(body);
+      stmt(s->getBody());
+      exit(n, 2);
+      break;
+    }
+    case 2:     // increment
+      branchTo(loops.back().next, loops.back().next);
+      stmt(s->getIncr());
+      exit(n, 3);
+      break;
+    default: {
+      Loop l = loops.back();
+      loops.pop_back();
+      branchTo(popBlock(), l.exit);
+      break;
+    }
+    }
+    break;
+  }
+
+  case ASTKind::UnaryMinusAST:
+    values.push_back(b.CreateNeg(convert(pop(), b.getInt32Ty())));
+    break;
+  case ASTKind::NotAST:
+    values.push_back(b.CreateNot(convert(pop(), b.getInt1Ty())));
+    break;
+  case ASTKind::AndAST:
+  case ASTKind::OrAST: {
+    // lhs ? rhs : false, and lhs ? true : rhs, with rhs in a block of its own
+    bool isAnd = n->getKind() == ASTKind::AndAST;
+    if (phase == 0) {
+      llvm::Value *l = convert(pop(), b.getInt1Ty());
+      llvm::BasicBlock *rhs = newBlock(isAnd ? "and.rhs" : "or.rhs");
+      llvm::BasicBlock *end = newBlock(isAnd ? "and.end" : "or.end");
+      if (isAnd) b.CreateCondBr(l, rhs, end);
+      else       b.CreateCondBr(l, end, rhs);
+      blocks.push_back(b.GetInsertBlock());
+      blocks.push_back(end);
+      b.SetInsertPoint(rhs);
+      expr(isAnd ? static_cast<AndAST*>(n)->getRHS() : static_cast<OrAST*>(n)->getRHS());
+      exit(n, 1);
+    } else {
+      llvm::Value *r = convert(pop(), b.getInt1Ty());
+      llvm::BasicBlock *rhsEnd = b.GetInsertBlock();
+      llvm::BasicBlock *end = popBlock(), *lhsEnd = popBlock();
+      branchTo(end, end);
+      llvm::PHINode *phi = b.CreatePHI(b.getInt1Ty(), 2);
+      phi->addIncoming(b.getInt1(!isAnd), lhsEnd);
+      phi->addIncoming(r, rhsEnd);
+      values.push_back(phi);
+    }
+    break;
+  }
+#define X(C) case ASTKind::C:
+  X(PlusAST) X(MinusAST) X(MultAST) X(DivAST) X(ModAST) X(LeftShiftAST) X(RightShiftAST)
+  X(LessThanAST) X(GreaterThanAST) X(LessEqualAST) X(GreaterEqualAST) X(EqualAST) X(NotEqualAST)
+#undef X
+  {
+    llvm::Value *r = pop(), *l = pop();
+    binary(n, l, r);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+// Target machine for the host CPU, used for the module's layout and by the
+// optimizer's cost model; null if the host target is not available.
+static std::unique_ptr<llvm::TargetMachine> hostTargetMachine(unsigned optLevel) {
+  static std::once_flag init;
+  std::call_once(init, [] {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+  });
+  std::string triple = llvm::sys::getDefaultTargetTriple(), error;
+  const llvm::Target *target = llvm::TargetRegistry::lookupTarget(triple, error);
+  if (!target) return nullptr;
+  llvm::CodeGenOpt::Level level = optLevel == 0 ? llvm::CodeGenOpt::None
+                                : optLevel == 1 ? llvm::CodeGenOpt::Less
+                                : optLevel == 2 ? llvm::CodeGenOpt::Default
+                                                : llvm::CodeGenOpt::Aggressive;
+  llvm::SubtargetFeatures features;
+  llvm::StringMap<bool> host;
+  if (llvm::sys::getHostCPUFeatures(host))
+    for (auto &f : host) features.AddFeature(f.first(), f.second);
+  return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+      triple, llvm::sys::getHostCPUName(), features.getString(), llvm::TargetOptions(),
+      llvm::Reloc::PIC_, llvm::None, level));
+}
+
+// Runs the standard -O<level> pipeline over `m`.
+static void optimizeModule(llvm::Module &m, llvm::TargetMachine *tm, unsigned level) {
+  if (level == 0) return;
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+  llvm::PassBuilder pb(tm);
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+  llvm::OptimizationLevel opt = level == 1 ? llvm::OptimizationLevel::O1
+                              : level == 2 ? llvm::OptimizationLevel::O2
+                                           : llvm::OptimizationLevel::O3;
+  pb.buildPerModuleDefaultPipeline(opt).run(m, mam);
+}
+
+// Builds the module for an analyzed program, verifies and optimizes it.
+// Returns null after reporting an error on `err`.
+static std::unique_ptr<llvm::Module> generateModule(decafAST *prog, llvm::LLVMContext &ctx,
+                                                    llvm::TargetMachine *tm, std::ostream &err) {
+  auto *root = dyn_cast<ProgramAST>(prog);
+  if (!root) return nullptr;
+  auto m = std::make_unique<llvm::Module>("decaf", ctx);
+  m->setTargetTriple(llvm::sys::getDefaultTargetTriple());
+  if (tm) m->setDataLayout(tm->createDataLayout());
+  CodegenWalker w(*m, err);
+  if (!w.run(root)) return nullptr;
+  std::string problems;
+  llvm::raw_string_ostream os(problems);
+  if (llvm::verifyModule(*m, &os)) {
+    err << "internal error: generated module is invalid\n" << os.str();
+    return nullptr;
+  }
+  optimizeModule(*m, tm, gOptions.optLevel);
+  return m;
+}
+
+// Runs the target's code generation passes over `m` and writes a
+// relocatable object to `path`.
+static bool writeObject(llvm::Module &m, llvm::TargetMachine &tm, const std::string &path,
+                        std::ostream &err) {
+  std::error_code ec;
+  llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_None);
+  if (ec) {
+    err << "error: cannot write " << path << ": " << ec.message() << "\n";
+    return false;
+  }
+  llvm::legacy::PassManager passes;
+  if (tm.addPassesToEmitFile(passes, out, nullptr, llvm::CGFT_ObjectFile)) {
+    err << "error: the target cannot write object files\n";
+    return false;
+  }
+  passes.run(m);
+  out.close();
+  if (out.has_error()) {
+    err << "error: cannot write " << path << ": " << out.error().message() << "\n";
+    out.clear_error();
+    return false;
+  }
+  return true;
+}
+
+// Links `object` and the runtime (an object, or decaf-stdlib.c itself) into
+// `exe` with $CC, default cc: the one process left of llvm-run's four.
+static bool linkExecutable(const std::string &object, const std::string &exe, std::ostream &err) {
+  const char *cc = getenv("CC");
+  std::istringstream words(cc && *cc ? cc : "cc");
+  std::vector<std::string> args;
+  for (std::string w; words >> w; ) args.push_back(w);
+  for (const char *a : { "-o", exe.c_str(), object.c_str(), gOptions.runtime.c_str() }) args.push_back(a);
+  std::vector<char*> argv;
+  for (std::string &a : args) argv.push_back(&a[0]);
+  argv.push_back(nullptr);
+  pid_t pid;
+  int status;
+  if (posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0 ||
+      waitpid(pid, &status, 0) != pid) {
+    err << "error: cannot run " << args[0] << "\n";
+    return false;
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    err << "error: linking " << exe << " failed\n";
+    return false;
+  }
+  return true;
+}
+
+// JIT-compiles `m` and calls its main() in this process, the way the
+// executable llvm-run links would run: externs bind to the runtime above
+// first and to anything else the process has (libc) after that. Returns
+// main's value, or 1 after reporting an error on `err`.
+static int runModule(std::unique_ptr<llvm::Module> m, std::unique_ptr<llvm::LLVMContext> ctx,
+                     std::ostream &err) {
+  llvm::Function *main = m->getFunction("main");
+  if (!main || main->isDeclaration() || main->arg_size() != 0) {
+    err << "Error: no main() to run\n";
+    return 1;
+  }
+  auto report = [&err](llvm::Error e) {
+    err << "error: " << llvm::toString(std::move(e)) << "\n";
+    return 1;
+  };
+  auto jit = llvm::orc::LLJITBuilder().create();
+  if (!jit) return report(jit.takeError());
+  llvm::orc::JITDylib &lib = (*jit)->getMainJITDylib();
+  llvm::orc::MangleAndInterner mangle((*jit)->getExecutionSession(), (*jit)->getDataLayout());
+  llvm::orc::SymbolMap runtime;
+  auto bind = [&](const char *name, void *fn) {
+    runtime[mangle(name)] = llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(fn),
+                                                     llvm::JITSymbolFlags::Exported);
+  };
+  bind("print_int", reinterpret_cast<void*>(&print_int));
+  bind("print_string", reinterpret_cast<void*>(&print_string));
+  bind("read_int", reinterpret_cast<void*>(&read_int));
+  if (llvm::Error e = lib.define(llvm::orc::absoluteSymbols(runtime))) return report(std::move(e));
+  auto process = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      (*jit)->getDataLayout().getGlobalPrefix());
+  if (!process) return report(process.takeError());
+  lib.addGenerator(std::move(*process));
+
+  m->setDataLayout((*jit)->getDataLayout());
+  if (llvm::Error e = (*jit)->addIRModule(llvm::orc::ThreadSafeModule(std::move(m), std::move(ctx))))
+    return report(std::move(e));
+  auto entry = (*jit)->lookup("main");
+  if (!entry) return report(entry.takeError());
+  auto *run = reinterpret_cast<int (*)()>(entry->getAddress());
+  int status = run();
+  decaf_flush();
+  return status;
+}
+
+// Writes the program's LLVM assembly to `err`, which is where llvm-run
+// collects it. Instead, --run executes it, and --emit-obj/--emit-exe write
+// native code straight from the module. Returns the exit status: 1 after
+// reporting an error on `err`, main's value for --run.
+static int emitProgram(decafAST *prog, std::ostream &err) {
+  auto ctx = std::make_unique<llvm::LLVMContext>();
+  std::unique_ptr<llvm::TargetMachine> tm = hostTargetMachine(gOptions.optLevel);
+  std::unique_ptr<llvm::Module> m = generateModule(prog, *ctx, tm.get(), err);
+  if (!m) return 1;
+  if (gOptions.run) return runModule(std::move(m), std::move(ctx), err);
+  if (gOptions.objectFile.empty() && gOptions.executable.empty()) {
+    llvm::raw_os_ostream os(err);
+    m->print(os, nullptr);
+    return 0;
+  }
+  if (!tm) {
+    err << "error: no code generator for " << llvm::sys::getDefaultTargetTriple() << "\n";
+    return 1;
+  }
+  if (!gOptions.objectFile.empty() && !writeObject(*m, *tm, gOptions.objectFile, err)) return 1;
+  if (gOptions.executable.empty()) return 0;
+  std::string object = gOptions.objectFile;
+  if (object.empty()) {
+    object = gOptions.executable + ".o";
+    if (!writeObject(*m, *tm, object, err)) return 1;
+  }
+  bool linked = linkExecutable(object, gOptions.executable, err);
+  if (gOptions.objectFile.empty()) std::remove(object.c_str());
+  return linked ? 0 : 1;
+}
+#endif // DECAF_CODEGEN
+
+// ---------------------------------------------------------------------------
+// AST images (see ast_cache.h)
+
+// Writes node records in post-order on the same kind of work stack as the
+// other walkers: visiting a node queues its children and then its own exit,
+// which writes the record once every child has an index.
+class AstImageSaver : public TreeWalker {
+  AstImageWriter &out;
+  std::unordered_map<decafAST*, uint32_t> index;
+
+  // fields() visitor that queues the children.
+  struct Children {
+    AstImageSaver &s;
+    template <class T> void operator()(T *&n) { if (n) s.schedule(WalkTask::Visit, n); }
+    void operator()(StmtList &l) { for (decafAST *n : l) if (n) s.schedule(WalkTask::Visit, n); }
+    template <class T> void operator()(T &) {}
+  };
+  // fields() visitor that writes the record.
+  struct Record {
+    AstImageSaver &s;
+    uint32_t ref(decafAST *n) { return n ? s.index.at(n) : ~0u; }
+    template <class T> void operator()(T *&n) { s.out.word(ref(n)); }
+    void operator()(StmtList &l) {
+      s.out.word(l.size());
+      for (decafAST *n : l) s.out.word(ref(n));
+    }
+    void operator()(Ident &n) { s.out.word(n.id); }
+    void operator()(int &v) { s.out.word(uint32_t(v)); }
+    void operator()(bool &v) { s.out.word(v); }
+    void operator()(char &v) { s.out.word((unsigned char)v); }
+    void operator()(std::string_view &v) { s.out.bytes(v); }
+  };
+
+public:
+  explicit AstImageSaver(AstImageWriter &w) : out(w) {}
+  size_t size() const { return index.size(); }
+
+  void run(decafAST *root) {
+    schedule(WalkTask::Visit, root);
+    WalkTask t;
+    while (next(t)) {
+      if (index.count(t.node)) continue;
+      if (t.op == WalkTask::Visit) {
+        Children c{*this};
+        dispatch(t.node, [&c](auto *n) { n->fields(c); });
+        schedule(WalkTask::Exit, t.node);
+      } else {
+        Record r{*this};
+        out.word(uint32_t(t.node->getKind()));
+        out.word(uint32_t(t.node->getLine()));
+        dispatch(t.node, [&r](auto *n) { n->fields(r); });
+        index.emplace(t.node, index.size());
+      }
+    }
+  }
+};
+
+// fields() visitor that reads a record back; children are already built.
+// Anything out of range marks the image as damaged instead of being used.
+struct AstImageLoader {
+  AstImageReader &in;
+  std::vector<decafAST*> nodes;
+  std::vector<SymbolId> names;   // image name index -> id in gNames
+  bool damaged = false;
+
+  template <class T> T* node(uint32_t i) {
+    if (i == ~0u) return nullptr;
+    if (i >= nodes.size()) { damaged = true; return nullptr; }
+    decafAST *n = nodes[i];
+    if constexpr (!std::is_same_v<T, decafAST>) {
+      if (n->getKind() != KindOf<T>::value) { damaged = true; return nullptr; }
+    }
+    return static_cast<T*>(n);
+  }
+
+  template <class T> void operator()(T *&n) { n = node<T>(in.word()); }
+  void operator()(StmtList &l) {
+    for (uint32_t k = in.word(); k > 0 && in.ok(); --k) l.push_back(node<decafAST>(in.word()));
+  }
+  void operator()(Ident &n) {
+    uint32_t i = in.word();
+    if (i < names.size()) n = names[i];
+    else damaged = true;
+  }
+  void operator()(int &v) { v = int(in.word()); }
+  void operator()(bool &v) { v = in.word() != 0; }
+  void operator()(char &v) { v = char(in.word()); }
+  void operator()(std::string_view &v) { v = gArena.copyString(in.bytes()); }
+};
+
+static decafAST* newNode(ASTKind k) {
+  switch (k) {
+#define X(C) case ASTKind::C: return new C(AstLoadTag());
+    DECAF_AST_NODES(X)
+#undef X
+    default: return nullptr;
+  }
+}
+
+// fields() visitor that hashes what kind of field each one is, and for a
+// typed child, the kind it must have.
+struct AstLayoutHasher {
+  Hasher &h;
+  template <class T> void operator()(T *&) {
+    h.u64('c');
+    if constexpr (std::is_same_v<T, decafAST>) h.u64(uint64_t(ASTKind::NumKinds));
+    else h.u64(uint64_t(KindOf<T>::value));
+  }
+  void operator()(StmtList &) { h.u64('l'); }
+  void operator()(Ident &) { h.u64('n'); }
+  void operator()(int &) { h.u64('i'); }
+  void operator()(bool &) { h.u64('b'); }
+  void operator()(char &) { h.u64('h'); }
+  void operator()(std::string_view &) { h.u64('s'); }
+};
+
+// Fingerprint of the image layout: every kind's name and tag, and the
+// fields() sequence of its records.
+static uint64_t astLayout() {
+  static const uint64_t layout = [] {
+    Hasher h;
+    AstLayoutHasher f{h};
+#define X(C) { C n((AstLoadTag())); h.str(#C); h.u64(uint64_t(ASTKind::C)); n.fields(f); h.u64('.'); }
+    DECAF_AST_NODES(X)
+#undef X
+    return h.h;
+  }();
+  return layout;
+}
+
+// Serializes the tree under `root` for a source of the given hash and size.
+std::string saveAstImage(decafAST *root, uint64_t sourceHash, uint64_t sourceSize) {
+  AstImageHeader h;
+  h.layout = astLayout();
+  h.sourceHash = sourceHash;
+  h.sourceSize = sourceSize;
+  h.names = gNames.size();
+  AstImageWriter w(h);
+  for (SymbolId i = 0; i < gNames.size(); ++i) w.bytes(gNames.spelling(i));
+  AstImageSaver s(w);
+  s.run(root);
+  w.header().nodes = s.size();
+  return w.image();
+}
+
+// Rebuilds the tree from an image in the current gArena and gNames. Returns
+// null if the image is for a different source or node layout, or is damaged.
+decafAST* loadAstImage(const char *data, size_t size, uint64_t sourceHash, uint64_t sourceSize) {
+  AstImageReader in(data, size);
+  AstImageHeader h;
+  if (!in.header(h) || h.layout != astLayout() || h.sourceHash != sourceHash || h.sourceSize != sourceSize || h.nodes == 0)
+    return nullptr;
+  AstImageLoader l{in};
+  l.names.reserve(h.names);
+  for (uint32_t i = 0; i < h.names && in.ok(); ++i) l.names.push_back(gNames.intern(in.bytes()));
+  l.nodes.reserve(h.nodes);
+  for (uint32_t i = 0; i < h.nodes && in.ok() && !l.damaged; ++i) {
+    uint32_t kind = in.word();
+    int line = int(in.word());
+    decafAST *n = kind < uint32_t(ASTKind::NumKinds) ? newNode(ASTKind(kind)) : nullptr;
+    if (!n) return nullptr;
+    n->setLine(line);
+    dispatch(n, [&l](auto *c) { c->fields(l); });
+    l.nodes.push_back(n);
+  }
+  if (!in.ok() || l.damaged || !in.atEnd() || l.nodes.size() != h.nodes) return nullptr;
+  return l.nodes.back();
+}
+
+// ---------------------------------------------------------------------------
+// Driver
+
+// Supplied by the grammar (decafsym.y): parses one program from `in` and
+// returns its root, or null after reporting a syntax error on `err`. It only
+// builds the tree; analyzing and printing it is runCompile's job. The
+// generated scanner and parser keep their state in globals, so callers hold
+// parseLock; analysis runs unlocked.
+decafAST* parseDecaf(FILE *in, std::ostream &err);
+// The same, but scans text[0, size) in place with yy_scan_buffer();
+// text[size] and text[size + 1] must be NUL. Token values are passed to the
+// actions as views into `text`. A grammar that does this defines
+// DECAF_PARSE_BUFFER before including this file; otherwise --mmap reads the
+// mapping through a stream, and every string constant is copied.
+#ifdef DECAF_PARSE_BUFFER
+decafAST* parseDecafBuffer(char *text, size_t size, std::ostream &err);
+#else
+decafAST* parseDecafBuffer(char *text, size_t size, std::ostream &err) {
+  FILE *in = fmemopen(text, size, "r");
+  if (!in) {
+    err << "error: cannot read the source buffer\n";
+    return nullptr;
+  }
+  decafAST *prog = parseDecaf(in, err);
+  fclose(in);
+  return prog;
+}
+#endif
+std::mutex parseLock;
+
+// What --stats reports, summed over every compilation in the process.
+struct CompileStats {
+  size_t files = 0;
+  double parse = 0, analyze = 0, prettyPrint = 0, codegen = 0, teardown = 0;   // wall seconds
+  uint64_t arenaAllocations = 0, arenaBytes = 0;
+#ifdef DECAF_STATS
+  SymbolStats sym;
+  InternStats names;
+  uint64_t nodes[static_cast<int>(ASTKind::NumKinds)] = {};
+  uint64_t stringBytesInPlace = 0, stringBytesCopied = 0;
+#endif
+
+  void add(const CompileStats &o) {
+    files += o.files;
+    parse += o.parse;
+    analyze += o.analyze;
+    prettyPrint += o.prettyPrint;
+    codegen += o.codegen;
+    teardown += o.teardown;
+    arenaAllocations += o.arenaAllocations;
+    arenaBytes += o.arenaBytes;
+#ifdef DECAF_STATS
+    sym.add(o.sym);
+    names.add(o.names);
+    stringBytesInPlace += o.stringBytesInPlace;
+    stringBytesCopied += o.stringBytesCopied;
+    for (int k = 0; k < static_cast<int>(ASTKind::NumKinds); ++k) nodes[k] += o.nodes[k];
+#endif
+  }
+
+  // Moves this thread's counters into the record and zeroes them.
+  void collectCounters() {
+    arenaAllocations += gArena.numAllocations();
+    arenaBytes += gArena.numBytes();
+#ifdef DECAF_STATS
+    stringBytesInPlace += StringConstantAST::bytesInPlace;
+    stringBytesCopied += StringConstantAST::bytesCopied;
+    StringConstantAST::bytesInPlace = StringConstantAST::bytesCopied = 0;
+    sym.add(gSym.stats);
+    gSym.stats = SymbolStats();
+    names.add(gNames.stats);
+    gNames.stats = InternStats();
+    for (int k = 0; k < static_cast<int>(ASTKind::NumKinds); ++k) {
+      nodes[k] += decafAST::nodesByKind[k];
+      decafAST::nodesByKind[k] = 0;
+    }
+#endif
+  }
+
+  void print(std::ostream &out) const {
+    char line[128];
+    out << "--- stats: " << files << (files == 1 ? " file" : " files") << " ---\n";
+    snprintf(line, sizeof line, "  %-24s %10.3f ms\n", "parse (incl. lex)", parse * 1e3);
+    out << line;
+    snprintf(line, sizeof line, "  %-24s %10.3f ms\n", "analyze", analyze * 1e3);
+    out << line;
+    snprintf(line, sizeof line, "  %-24s %10.3f ms\n", "prettyPrint", prettyPrint * 1e3);
+    out << line;
+    if (gOptions.codegen) {
+      snprintf(line, sizeof line, "  %-24s %10.3f ms\n", "codegen", codegen * 1e3);
+      out << line;
+    }
+    snprintf(line, sizeof line, "  %-24s %10.3f ms\n", "teardown", teardown * 1e3);
+    out << line;
+    snprintf(line, sizeof line, "  %-24s %10llu allocations, %llu bytes\n", "arena",
+             (unsigned long long)arenaAllocations, (unsigned long long)arenaBytes);
+    out << line;
+#ifdef DECAF_STATS
+    auto count = [&](const char *name, uint64_t v) {
+      snprintf(line, sizeof line, "  %-24s %10llu\n", name, (unsigned long long)v);
+      out << line;
+    };
+    count("SymbolStack::push", sym.pushes);
+    count("SymbolStack::pop", sym.pops);
+    count("SymbolStack::lookup", sym.lookups);
+    snprintf(line, sizeof line, "  %-24s %10.2f avg, %llu max\n", "scopes walked/lookup",
+             sym.lookups ? double(sym.scopesWalked) / sym.lookups : 0.0,
+             (unsigned long long)sym.maxScopesWalked);
+    out << line;
+    count("SymbolStack::insert", sym.inserts);
+    count("insert collisions", sym.insertCollisions);
+    count("interner lookups", names.interns);
+    count("interner hash probes", names.probes);
+    count("string bytes in place", stringBytesInPlace);
+    count("string bytes copied", stringBytesCopied);
+    out << "  AST nodes by kind:\n";
+    for (int k = 0; k < static_cast<int>(ASTKind::NumKinds); ++k) {
+      if (!nodes[k]) continue;
+      snprintf(line, sizeof line, "    %-22s %10llu\n", kindName(static_cast<ASTKind>(k)),
+               (unsigned long long)nodes[k]);
+      out << line;
+    }
+#else
+    out << "  (structure counters need a build with -DDECAF_STATS)\n";
+#endif
+  }
+};
+
+CompileStats gTotals;
+std::mutex gTotalsLock;
+
+// Compiles one program against this thread's per-compilation state and
+// leaves that state empty for the next one: the analyzed tree, with every
+// use annotated with its declaration's line, goes to `out`, the traces and
+// errors to `err`. Returns the exit status (with --run, the program's).
+// `front` builds the tree (parsing it, or loading a cached image) and returns
+// null on failure; it counts as the parse phase.
+template <class Front>
+static int runCompile(Front front, std::ostream &out, std::ostream &err) {
+  typedef std::chrono::steady_clock Clock;
+  CompileStats st;
+  gDiag.setStream(err);
+  gDiag.setFormat(gOptions.diagFormat);
+  if (!gOptions.traces) gDiag.setTraces(false);
+#ifdef DECAF_CODEGEN
+  // only the IR may reach the stream the IR goes to
+  if (gOptions.codegen) gDiag.setTraces(false);
+  size_t errors = gDiag.errorCount();
+#endif
+  Clock::time_point t0, t1, t2, tp, t3, t4;
+  t0 = Clock::now();
+  decafAST *prog = front();
+  t1 = Clock::now();
+  if (prog) prog->Analyze();
+  if (prog && (gOptions.fold || gOptions.codegen)) prog->Fold();
+  t2 = Clock::now();
+  if (prog) {
+    gDiag.flush();   // traces and errors precede what the printer writes
+    prog->prettyPrint(out);
+  }
+  tp = Clock::now();
+  int status = prog ? 0 : 1;
+#ifdef DECAF_CODEGEN
+  if (prog && gOptions.codegen) status = gDiag.errorCount() != errors ? 1 : emitProgram(prog, err);
+#endif
+  t3 = Clock::now();
+  gDiag.setStream(std::cerr);
+  if (gOptions.stats) st.collectCounters();
+  gArena.release();
+  gNames.clear();
+  gDecls.clear();
+  t4 = Clock::now();
+  if (gOptions.stats) {
+    st.files = 1;
+    st.parse = std::chrono::duration<double>(t1 - t0).count();
+    st.analyze = std::chrono::duration<double>(t2 - t1).count();
+    st.prettyPrint = std::chrono::duration<double>(tp - t2).count();
+    st.codegen = std::chrono::duration<double>(t3 - tp).count();
+    st.teardown = std::chrono::duration<double>(t4 - t3).count();
+    std::lock_guard<std::mutex> lock(gTotalsLock);
+    gTotals.add(st);
+  }
+  return status;
+}
+
+int compileStream(FILE *in, std::ostream &out, std::ostream &err) {
+  return runCompile([&] {
+    std::lock_guard<std::mutex> lock(parseLock);
+    return parseDecaf(in, err);
+  }, out, err);
+}
+
+// Compiles `path` through a mapping of the file. With --ast-cache the tree
+// comes from the image next to it when that image was made from the same
+// source, and a fresh image is left behind otherwise; with --mmap the
+// scanner works on the mapping in place.
+static int compileSource(const std::string &path, std::ostream &out, std::ostream &err) {
+  SourceBuffer src(path);
+  if (!src.ok()) {
+    err << "error: cannot open " << path << "\n";
+    return 1;
+  }
+  uint64_t hash = 0;
+  std::string imagePath = path + ".ast";
+  if (gOptions.astCache) {
+    Hasher h;
+    h.bytes(src.data(), src.size());
+    hash = h.h;
+  }
+  gSource = &src;
+  int status = runCompile([&]() -> decafAST* {
+    if (gOptions.astCache) {
+      MappedFile image(imagePath);
+      if (image.ok()) {
+        if (decafAST *prog = loadAstImage(image.data(), image.size(), hash, src.size()))
+          return prog;
+        // whatever a damaged image left behind
+        gArena.release();
+        gNames.clear();
+      }
+    }
+    decafAST *prog;
+    {
+      std::lock_guard<std::mutex> lock(parseLock);
+      if (gOptions.mmapInput) {
+        prog = parseDecafBuffer(src.data(), src.size(), err);
+      } else {
+        FILE *in = fopen(path.c_str(), "r");
+        if (!in) {
+          err << "error: cannot open " << path << "\n";
+          return nullptr;
+        }
+        prog = parseDecaf(in, err);
+        fclose(in);
+      }
+    }
+    if (prog && gOptions.astCache)
+      writeAstImage(imagePath, saveAstImage(prog, hash, src.size()));
+    return prog;
+  }, out, err);
+  gSource = nullptr;
+  return status;
+}
+
+struct CompileResult {
+  std::string out, err;
+  int status = 0;
+};
+
+CompileResult compileFile(const std::string &path) {
+  CompileResult r;
+  std::ostringstream out, err;
+  if (gOptions.astCache || gOptions.mmapInput) {
+    r.status = compileSource(path, out, err);
+  } else if (FILE *in = fopen(path.c_str(), "r")) {
+    r.status = compileStream(in, out, err);
+    fclose(in);
+  } else {
+    err << "error: cannot open " << path << "\n";
+    r.status = 1;
+  }
+  r.out = out.str();
+  r.err = err.str();
+  return r;
+}
+
+// A directory stands for its .decaf files and those of its immediate
+// subdirectories, which is how testcases/ is laid out.
+void collectInputs(const std::filesystem::path &arg, std::vector<std::filesystem::path> &files) {
+  namespace fs = std::filesystem;
+  if (!fs::is_directory(arg)) {
+    files.push_back(arg);
+    return;
+  }
+  std::vector<fs::path> found;
+  for (const fs::directory_entry &e : fs::directory_iterator(arg)) {
+    if (e.is_directory()) {
+      for (const fs::directory_entry &f : fs::directory_iterator(e.path()))
+        if (f.path().extension() == ".decaf") found.push_back(f.path());
+    } else if (e.path().extension() == ".decaf") {
+      found.push_back(e.path());
+    }
+  }
+  std::sort(found.begin(), found.end());
+  files.insert(files.end(), found.begin(), found.end());
+}
+
+static bool writeFile(const std::filesystem::path &p, const std::string &text) {
+  std::ofstream f(p, std::ios::binary);
+  f.write(text.data(), text.size());
+  return bool(f);
+}
+
+// Compiles every file on a pool of gOptions.jobs workers in one process and
+// writes each result next to the others in its group. Returns the number of
+// files that failed to compile or to write.
+int compileBatch(const std::vector<std::filesystem::path> &files) {
+  namespace fs = std::filesystem;
+  ThreadPool pool(gOptions.jobs);
+  std::atomic<int> failures(0);
+  pool.parallelFor(files.size(), [&](size_t i, unsigned) {
+    const fs::path &src = files[i];
+    CompileResult r = compileFile(src.string());
+    fs::path dir = fs::path(gOptions.outputDir) / src.parent_path().filename();
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    std::string base = src.stem().string();
+    bool ok = writeFile(dir / (base + ".out"), r.out) &&
+              writeFile(dir / (base + ".err"), r.err) &&
+              writeFile(dir / (base + ".ret"), std::to_string(r.status) + "\n");
+    if (!ok) std::cerr << "error: cannot write output for " + src.string() + "\n";
+    if (!ok || r.status) ++failures;
+  });
+  return failures;
+}
+
+static bool readFile(const std::filesystem::path &p, std::string &text) {
+  std::ifstream f(p, std::ios::binary);
+  if (!f) return false;
+  std::ostringstream buf;
+  buf << f.rdbuf();
+  text = buf.str();
+  return true;
+}
+
+// One references directory and the testcases directory it was made from.
+struct CheckGroup {
+  std::filesystem::path refs, tests;
+};
+
+// Compiles every test that has a reference .out in each group, all groups on
+// one pool, and compares stdout/stderr in memory. Prints one check.sh style
+// report per group and returns the number of tests that did not match.
+int checkConformance(const std::filesystem::path &testsDir, const std::filesystem::path &refsDir) {
+  namespace fs = std::filesystem;
+  std::vector<CheckGroup> groups;
+  bool flat = false;
+  std::vector<fs::path> subdirs;
+  for (const fs::directory_entry &e : fs::directory_iterator(refsDir)) {
+    if (e.is_directory()) subdirs.push_back(e.path().filename());
+    else if (e.path().extension() == ".out") flat = true;
+  }
+  std::sort(subdirs.begin(), subdirs.end());
+  if (flat) groups.push_back(CheckGroup{refsDir, testsDir});
+  for (const fs::path &d : subdirs)
+    groups.push_back(CheckGroup{refsDir / d, testsDir / d});
+
+  enum Status { OK, OutMismatch, ErrMismatch, BothMismatch, Missing };
+  struct Case {
+    size_t group;
+    std::string base;
+    Status status = OK;
+  };
+  std::vector<Case> cases;
+  for (size_t g = 0; g < groups.size(); ++g) {
+    std::vector<std::string> bases;
+    for (const fs::directory_entry &e : fs::directory_iterator(groups[g].refs))
+      if (e.path().extension() == ".out") bases.push_back(e.path().stem().string());
+    std::sort(bases.begin(), bases.end());
+    for (const std::string &b : bases) cases.push_back(Case{g, b});
+  }
+
+  ThreadPool pool(gOptions.jobs);
+  pool.parallelFor(cases.size(), [&](size_t i, unsigned) {
+    Case &c = cases[i];
+    const CheckGroup &g = groups[c.group];
+    fs::path src = g.tests / (c.base + ".decaf");
+    std::string refOut, refErr;
+    if (!fs::exists(src) || !readFile(g.refs / (c.base + ".out"), refOut) ||
+        !readFile(g.refs / (c.base + ".err"), refErr)) {
+      c.status = Missing;
+      return;
+    }
+    CompileResult r = compileFile(src.string());
+    bool outOk = r.out == refOut, errOk = r.err == refErr;
+    c.status = outOk ? (errOk ? OK : ErrMismatch) : (errOk ? OutMismatch : BothMismatch);
+  });
+
+  static const char *const statusName[] = { "OK", "out-mismatch", "err-mismatch", "both-mismatch" };
+  int failed = 0;
+  size_t next = 0;
+  for (size_t g = 0; g < groups.size(); ++g) {
+    int total = 0, perfect = 0, outFail = 0, errFail = 0, missing = 0;
+    printf("\nComparing %s ⇔ %s …\n\n",
+           groups[g].refs.string().c_str(), groups[g].tests.string().c_str());
+    for (; next < cases.size() && cases[next].group == g; ++next) {
+      const Case &c = cases[next];
+      ++total;
+      if (c.status == Missing) {
+        printf("✗ %-20s  (missing file)\n", c.base.c_str());
+        ++missing;
+        continue;
+      }
+      if (c.status == OutMismatch || c.status == BothMismatch) ++outFail;
+      if (c.status == ErrMismatch || c.status == BothMismatch) ++errFail;
+      if (c.status == OK) ++perfect;
+      else printf("✗ %-20s  (%s)\n", c.base.c_str(), statusName[c.status]);
+    }
+    failed += total - perfect;
+    printf("\n──────────────── summary ────────────────\n");
+    printf(" test-cases checked : %3d\n", total);
+    printf(" perfect matches    : %3d\n", perfect);
+    printf(" out mismatches     : %3d\n", outFail);
+    printf(" err mismatches     : %3d\n", errFail);
+    printf(" missing files      : %3d\n", missing);
+    printf("──────────────────────────────────────────\n");
+  }
+  fflush(stdout);
+  return failed;
+}
+
+// Discards everything written to it, so the printer and the diagnostics do
+// their full formatting work without I/O in the measurement.
+class NullBuffer : public std::streambuf {
+protected:
+  int overflow(int c) override { return c; }
+  std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+// Where the flex scanner found a token: its lineno and tokenpos when the
+// token started, and yyleng.
+struct LexedToken {
+  int line, column, length;
+  bool operator==(const LexedToken &o) const { return line == o.line && column == o.column && length == o.length; }
+};
+
+// Supplied by the scanner (decafsym.lex): tokenizes all of `in` without
+// parsing and returns the number of tokens, appending each one's position
+// to `at` if given. Same locking rule as parseDecaf.
+size_t lexDecaf(FILE *in, std::vector<LexedToken> *at = nullptr);
+
+// Compiles a generated program `reps` times and reports the median time of
+// every phase. Lexing is timed on its own; the parse phase runs the scanner
+// again, so "parse" is reported net of the lexing median. Each parsed tree
+// is also saved as an AST image and loaded back, and the loaded copy is the
+// one analyzed; loading is what --ast-cache does instead of lexing and
+// parsing, so it is reported beside the total rather than in it, as is a
+// parse of the same text scanned in place (what --mmap does). Returns 1 if
+// the hand-written scanner disagreed with itself or with flex.
+int runBenchmark(const GenConfig &cfg, int reps) {
+  typedef std::chrono::steady_clock Clock;
+  enum { Lex, Parse, Analyze, Print, Teardown, NumPhases, AstLoad = NumPhases, InPlace, NumTimes };
+  static const char *const phaseName[] = { "lex", "parse", "analyze", "prettyPrint", "teardown",
+                                           "ast load", "in-place" };
+
+  ProgramGenerator gen(cfg);
+  std::string src = gen.generate();
+  NullBuffer nullBuf;
+  std::ostream sink(&nullBuf);
+  std::vector<double> times[NumTimes];
+  size_t tokens = 0, nodes = 0;
+  std::string image;   // the last rep's, for the thread comparison
+
+  auto seconds = [](Clock::time_point a, Clock::time_point b) {
+    return std::chrono::duration<double>(b - a).count();
+  };
+  for (int rep = 0; rep <= reps; ++rep) {   // rep 0 warms up and is dropped
+    FILE *in = fmemopen(const_cast<char*>(src.data()), src.size(), "r");
+    Clock::time_point t0 = Clock::now();
+    tokens = lexDecaf(in);
+    Clock::time_point t1 = Clock::now();
+    rewind(in);
+    gDiag.setStream(sink);
+    decafAST *prog = parseDecaf(in, sink);
+    Clock::time_point t2 = Clock::now();
+    fclose(in);
+    if (!prog) {
+      std::cerr << "bench: generated program did not parse\n";
+      return 1;
+    }
+    // token values may point into the buffer only while it is gSource,
+    // as in compileSource
+    SourceBuffer text(src);
+    gSource = &text;
+    Clock::time_point b0 = Clock::now();
+    parseDecafBuffer(text.data(), text.size(), sink);
+    Clock::time_point b1 = Clock::now();
+    gSource = nullptr;
+    image = saveAstImage(prog, 0, src.size());
+    AstImageHeader h;   // its node count is the tree's, without a counter in operator new
+    AstImageReader(image.data(), image.size()).header(h);
+    nodes = h.nodes;
+    Clock::time_point l0 = Clock::now();
+    prog = loadAstImage(image.data(), image.size(), 0, src.size());
+    Clock::time_point l1 = Clock::now();
+    prog->Analyze();
+    gDiag.flush();
+    Clock::time_point t3 = Clock::now();
+    prog->prettyPrint(sink);
+    sink.flush();
+    Clock::time_point t4 = Clock::now();
+    gArena.release();
+    gNames.clear();
+    gDecls.clear();
+    Clock::time_point t5 = Clock::now();
+    gDiag.setStream(std::cerr);
+    if (rep == 0) continue;
+    times[Lex].push_back(seconds(t0, t1));
+    times[Parse].push_back(seconds(t1, t2));
+    times[Analyze].push_back(seconds(l1, t3));
+    times[AstLoad].push_back(seconds(l0, l1));
+    times[InPlace].push_back(seconds(b0, b1));
+    times[Print].push_back(seconds(t3, t4));
+    times[Teardown].push_back(seconds(t4, t5));
+  }
+
+  // Analysis alone on one thread and on `parallel` (-t, or one per
+  // hardware thread), each run on a tree loaded from the image.
+  unsigned savedThreads = gOptions.analyzeThreads;
+  unsigned parallel = savedThreads > 1 ? savedThreads : ThreadPool::defaultThreads();
+  double analyzeAt[2] = {};
+  for (int c = 0; c < 2 && parallel > 1; ++c) {
+    gOptions.analyzeThreads = c ? parallel : 1;
+    std::vector<double> runs;
+    for (int rep = 0; rep <= reps; ++rep) {
+      gDiag.setStream(sink);
+      decafAST *prog = loadAstImage(image.data(), image.size(), 0, src.size());
+      Clock::time_point a0 = Clock::now();
+      prog->Analyze();
+      gDiag.flush();
+      Clock::time_point a1 = Clock::now();
+      gArena.release();
+      gNames.clear();
+      gDecls.clear();
+      gDiag.setStream(std::cerr);
+      if (rep > 0) runs.push_back(seconds(a0, a1));
+    }
+    std::sort(runs.begin(), runs.end());
+    analyzeAt[c] = runs[runs.size() / 2];
+  }
+  gOptions.analyzeThreads = savedThreads;
+
+  double median[NumTimes], total = 0;
+  for (int p = 0; p < NumTimes; ++p) {
+    std::vector<double> &v = times[p];
+    std::sort(v.begin(), v.end());
+    median[p] = v[v.size() / 2];
+  }
+  median[Parse] = std::max(0.0, median[Parse] - median[Lex]);
+  for (int p = 0; p < NumPhases; ++p) total += median[p];
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("config: fields=%d methods=%d depth=%d vars=%d shadow=%d%% expr=%d calls=%d comments=%d "
+         "strings=%d seed=%llu\n", cfg.fields, cfg.methods, cfg.depth, cfg.varsPerBlock,
+         cfg.shadowPercent, cfg.exprLength, cfg.callSites, cfg.comments, cfg.strings,
+         (unsigned long long)cfg.seed);
+  printf("input:  %d lines, %zu bytes, %zu tokens, %zu nodes; median of %d runs\n\n",
+         gen.numLines(), src.size(), tokens, nodes, reps);
+  printf("  %-12s %10s %14s %14s\n", "phase", "ms", "lines/sec", "nodes/sec");
+  for (int p = 0; p <= NumPhases; ++p) {
+    double t = p < NumPhases ? median[p] : total;
+    const char *name = p < NumPhases ? phaseName[p] : "total";
+    if (t > 0)
+      printf("  %-12s %10.3f %14.0f %14.0f\n", name, t * 1e3, gen.numLines() / t, nodes / t);
+    else
+      printf("  %-12s %10.3f %14s %14s\n", name, 0.0, "-", "-");
+  }
+  printf("\n");
+  for (int p = AstLoad; p < NumTimes; ++p) {
+    double t = median[p];
+    if (t > 0)
+      printf("  %-12s %10.3f %14.0f %14.0f  (%.2fx lex+parse)\n", phaseName[p], t * 1e3,
+             gen.numLines() / t, nodes / t, t / (median[Lex] + median[Parse]));
+  }
+  if (analyzeAt[0] > 0 && analyzeAt[1] > 0) {
+    printf("\n");
+    for (int c = 0; c < 2; ++c) {
+      char name[32];
+      snprintf(name, sizeof name, "analyze -t %u", c ? parallel : 1);
+      printf("  %-12s %10.3f %14.0f %14.0f", name, analyzeAt[c] * 1e3,
+             gen.numLines() / analyzeAt[c], nodes / analyzeAt[c]);
+      if (c) printf("  (%.2fx speedup)", analyzeAt[0] / analyzeAt[1]);
+      printf("\n");
+    }
+  }
+
+  // The hand-written scanner with each kernel set this machine has. It is
+  // not used for compiling; this is where it is checked. Every set must
+  // produce the same tokens as the scalar one (else MISMATCH), and the same
+  // token boundaries, lines and columns as flex (else DIFFERS FROM FLEX).
+  printf("\nscanning %zu bytes:\n", src.size());
+  if (median[Lex] > 0)
+    printf("  %-12s %10.3f %11.1f MB/s %10zu tokens\n", "flex", median[Lex] * 1e3,
+           src.size() / median[Lex] / 1e6, tokens);
+  std::vector<LexedToken> flexAt;
+  {
+    FILE *in = fmemopen(const_cast<char*>(src.data()), src.size(), "r");
+    lexDecaf(in, &flexAt);
+    fclose(in);
+  }
+  uint64_t expected = 0;
+  bool agree = true;
+  for (const ScanKernels &k : availableScanKernels()) {
+    std::vector<double> runs;
+    size_t count = 0;
+    for (int rep = 0; rep <= reps; ++rep) {
+      Clock::time_point s0 = Clock::now();
+      FastScanner scan(src, k);
+      ScannedToken t;
+      for (count = 0; scan.next(t); ++count) {}
+      Clock::time_point s1 = Clock::now();
+      if (rep > 0) runs.push_back(seconds(s0, s1));
+    }
+    Hasher h;
+    std::vector<LexedToken> at;
+    FastScanner scan(src, k);
+    ScannedToken t;
+    while (scan.next(t)) {
+      uint32_t v[4] = { uint32_t(t.kind), uint32_t(t.line), uint32_t(t.column), uint32_t(t.text.size()) };
+      h.bytes(v, sizeof v);
+      at.push_back(LexedToken{t.line, t.column, int(t.text.size())});
+    }
+    if (&k == &availableScanKernels().front()) expected = h.h;
+    std::sort(runs.begin(), runs.end());
+    double secs = runs[runs.size() / 2];
+    printf("  %-12s %10.3f %11.1f MB/s %10zu tokens%s%s\n", k.name, secs * 1e3,
+           secs > 0 ? src.size() / secs / 1e6 : 0.0, count, h.h == expected ? "" : "  MISMATCH",
+           at == flexAt ? "" : "  DIFFERS FROM FLEX");
+    agree = agree && h.h == expected && at == flexAt;
+  }
+  printf("\npeak RSS: %ld KiB\n", ru.ru_maxrss);
+  return agree ? 0 : 1;
+}
+
+static void usage(std::ostream &out) {
+  out << "usage: decafsym                    compile stdin to stdout/stderr\n"
+         "       decafsym [options] input... compile .decaf files or directories\n"
+         "       decafsym [options] --check <testcases-dir> <references-dir>\n"
+         "       decafsym --bench [knob=value...]\n"
+         "options:\n"
+         "  -o <dir>   output directory for batch mode (default: output)\n"
+         "  -j <n>     files compiled in parallel (default: hardware threads)\n"
+         "  -t <n>     threads per file for method bodies (default: 1)\n"
+         "  --stats    report time per phase (and counters, if built with STATS=1)\n"
+         "  --cache <dir>  reuse analysis of unchanged methods across runs\n"
+         "  --ast-cache    load each file's tree from <file>.ast if unchanged\n"
+         "  --mmap         map input files and scan them in place\n"
+         "  --diagnostics=text|json  message format (default: text)\n"
+         "  --no-traces    leave out the \"defined variable\" traces\n"
+         "  --fold         fold constant expressions after analysis\n"
+         "  --scope-snapshots  keep the names visible on entry to every block\n"
+         "  --typecheck    report expressions of the wrong type\n"
+#ifdef DECAF_CODEGEN
+         "  -O[0-3]        optimize the generated IR (-O alone is -O2)\n"
+         "  --no-codegen   stop after analysis, like decafsym\n"
+         "  --run [file]   JIT-compile the program and run it; its input is stdin\n"
+         "  --emit-obj <file>  write a native object instead of the IR\n"
+         "  --emit-exe <file>  link an executable with $CC against the runtime\n"
+         "  --runtime <file>   runtime object or source (default: decaf-stdlib.o)\n"
+#endif
+         "benchmark knobs: fields methods depth vars shadow (percent) expr calls\n"
+         "                 comments strings seed reps\n";
+}
+
+// Entry point for the grammar's main(). With no inputs this is the original
+// filter: one program on stdin, annotated source on stdout, diagnostics on
+// stderr.
+int decafMain(int argc, char **argv) {
+  std::vector<std::filesystem::path> files;
+  std::string checkTests, checkRefs;
+  bool bench = false;
+  GenConfig gen;
+  int reps = 9;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--stats") {
+      gOptions.stats = true;
+    } else if (arg == "--ast-cache") {
+      gOptions.astCache = true;
+    } else if (arg == "--mmap") {
+      gOptions.mmapInput = true;
+    } else if (arg == "--diagnostics=text" || arg == "--diagnostics=json") {
+      gOptions.diagFormat = arg == "--diagnostics=json" ? Diagnostics::Json : Diagnostics::Text;
+    } else if (arg == "--no-traces") {
+      gOptions.traces = false;
+    } else if (arg == "--scope-snapshots") {
+      gOptions.scopeSnapshots = true;
+    } else if (arg == "--fold") {
+      gOptions.fold = true;
+    } else if (arg == "--typecheck") {
+      gOptions.typeCheck = true;
+#ifdef DECAF_CODEGEN
+    } else if (arg == "--no-codegen") {
+      gOptions.codegen = false;
+    } else if (arg == "--run") {
+      gOptions.run = true;
+    } else if ((arg == "--emit-obj" || arg == "--emit-exe" || arg == "--runtime") && i + 1 < argc) {
+      const char *val = argv[++i];
+      if (arg == "--emit-obj") gOptions.objectFile = val;
+      else if (arg == "--emit-exe") gOptions.executable = val;
+      else gOptions.runtime = val;
+    } else if (arg.size() <= 3 && arg.compare(0, 2, "-O") == 0 &&
+               (arg.size() == 2 || (arg[2] >= '0' && arg[2] <= '3'))) {
+      gOptions.optLevel = arg.size() == 2 ? 2 : arg[2] - '0';
+#endif
+    } else if ((arg == "-o" || arg == "-j" || arg == "-t") && i + 1 < argc) {
+      const char *val = argv[++i];
+      if (arg == "-o") gOptions.outputDir = val;
+      else if (arg == "-j") gOptions.jobs = atoi(val);
+      else gOptions.analyzeThreads = std::max(1, atoi(val));
+    } else if (arg == "--cache" && i + 1 < argc) {
+      gOptions.cacheDir = argv[++i];
+      std::error_code ec;
+      std::filesystem::create_directories(gOptions.cacheDir, ec);
+    } else if (arg == "--check" && i + 2 < argc) {
+      checkTests = argv[++i];
+      checkRefs = argv[++i];
+    } else if (arg == "--bench") {
+      bench = true;
+    } else if (bench && arg.find('=') != std::string::npos) {
+      std::string key = arg.substr(0, arg.find('='));
+      long val = atol(arg.c_str() + key.size() + 1);
+      if (key == "fields") gen.fields = val;
+      else if (key == "methods") gen.methods = val;
+      else if (key == "depth") gen.depth = val;
+      else if (key == "vars") gen.varsPerBlock = val;
+      else if (key == "shadow") gen.shadowPercent = val;
+      else if (key == "expr") gen.exprLength = val;
+      else if (key == "calls") gen.callSites = val;
+      else if (key == "comments") gen.comments = val;
+      else if (key == "strings") gen.strings = val;
+      else if (key == "seed") gen.seed = val;
+      else if (key == "reps") reps = std::max(1L, val);
+      else {
+        std::cerr << "decafsym: unknown benchmark knob " << key << "\n";
+        return 2;
+      }
+    } else if (arg == "-h" || arg == "--help") {
+      usage(std::cout);
+      return 0;
+    } else if (!arg.empty() && arg[0] == '-') {
+      std::cerr << "decafsym: unknown option " << arg << "\n";
+      usage(std::cerr);
+      return 2;
+    } else {
+      collectInputs(arg, files);
+    }
+  }
+
+  if (bench) return runBenchmark(gen, reps);
+  int status;
+#ifdef DECAF_CODEGEN
+  if (gOptions.run || !gOptions.objectFile.empty() || !gOptions.executable.empty()) {
+    // one program, read from the file if there is one; that leaves stdin
+    // to the program under --run
+    if (files.size() > 1 || !checkTests.empty() || !gOptions.codegen) {
+      usage(std::cerr);
+      return 2;
+    }
+    FILE *in = files.empty() ? stdin : fopen(files[0].c_str(), "r");
+    if (!in) {
+      std::cerr << "error: cannot open " << files[0].string() << "\n";
+      return 1;
+    }
+    NullBuffer null;
+    std::ostream discard(&null);
+    status = compileStream(in, discard, std::cerr);
+    if (in != stdin) fclose(in);
+    if (gOptions.stats) gTotals.print(std::cerr);
+    return status;
+  }
+#endif
+  if (!checkTests.empty()) {
+    if (!files.empty()) {
+      usage(std::cerr);
+      return 2;
+    }
+    status = checkConformance(checkTests, checkRefs) ? 1 : 0;
+  } else if (files.empty()) {
+    // decafexpr's output is the IR alone
+    NullBuffer null;
+    std::ostream discard(&null);
+    status = compileStream(stdin, gOptions.codegen ? discard : std::cout, std::cerr);
+  } else {
+    status = compileBatch(files) ? 1 : 0;
+  }
+  if (gOptions.stats) gTotals.print(std::cerr);
+  return status;
+}
@@ -0,0 +1,215 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "interner.h"
+#include "symbol_table.h"
+
+enum DiagKind {
+    DIAG_DEFINED,      // trace: a variable was entered into the symbol table
+    DIAG_REDECLARED,   // error: name already declared in the current scope
+    DIAG_UNDECLARED,   // error: name not visible in any enclosing scope
+    DIAG_TYPE,         // error: an expression has the wrong type (--typecheck)
+    DIAG_ARGS          // error: a call passes the wrong number of arguments
+};
+
+struct Diagnostic {
+    DiagKind    kind;
+    const char *what;   // "parameter", "field", "array variable", ...
+    SymbolId    name;
+    DecafType   type;       // DIAG_TYPE: the type found
+    int         line;
+    DecafType   expected = TYPE_UNKNOWN;   // DIAG_TYPE: the type required
+};
+
+// Collects the semantic analysis messages as records and writes them out in
+// large batches instead of one unbuffered std::cerr write per token. Text
+// mode reproduces the original messages byte for byte; Json mode writes one
+// object per line.
+class Diagnostics {
+public:
+    enum Format { Text, Json };
+
+private:
+    static const size_t FlushThreshold = 4096;   // records
+
+    std::vector<Diagnostic> records;
+    std::ostream *out = &std::cerr;   // null: collect only, never write
+    Format format = Text;
+    bool   traces = true;
+    size_t errors = 0;                // error records added so far
+
+    static void appendInt(std::string &buf, int v) {
+        char tmp[16];
+        buf.append(tmp, snprintf(tmp, sizeof tmp, "%d", v));
+    }
+
+    static void appendJsonString(std::string &buf, const std::string &s) {
+        buf += '"';
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                buf += '\\';
+                buf += c;
+            } else if ((unsigned char)c < 0x20) {
+                char tmp[8];
+                buf.append(tmp, snprintf(tmp, sizeof tmp, "\\u%04x", c));
+            } else {
+                buf += c;
+            }
+        }
+        buf += '"';
+    }
+
+    static void renderText(std::string &buf, const Diagnostic &d) {
+        const std::string &name = gNames.spelling(d.name);
+        switch (d.kind) {
+        case DIAG_DEFINED:
+            buf += "defined variable: ";
+            buf += name;
+            buf += ", with type: ";
+            buf += typeToString(d.type);
+            buf += ", on line number: ";
+            appendInt(buf, d.line);
+            buf += '\n';
+            break;
+        case DIAG_REDECLARED:
+        case DIAG_UNDECLARED:
+            buf += "Error: ";
+            buf += d.what;
+            buf += " '";
+            buf += name;
+            buf += d.kind == DIAG_REDECLARED ? "' redeclared (line " : "' not declared (line ";
+            appendInt(buf, d.line);
+            buf += ")\n";
+            break;
+        case DIAG_TYPE:
+            buf += "Error: ";
+            buf += d.what;
+            if (!name.empty()) {
+                buf += " '";
+                buf += name;
+                buf += '\'';
+            }
+            buf += " has type ";
+            buf += typeToString(d.type);
+            buf += ", expected ";
+            buf += typeToString(d.expected);
+            buf += " (line ";
+            appendInt(buf, d.line);
+            buf += ")\n";
+            break;
+        case DIAG_ARGS:
+            buf += "Error: wrong number of arguments to '";
+            buf += name;
+            buf += "' (line ";
+            appendInt(buf, d.line);
+            buf += ")\n";
+            break;
+        }
+    }
+
+    static void renderJson(std::string &buf, const Diagnostic &d) {
+        static const char *const kinds[] = { "defined", "redeclared", "undeclared", "type",
+                                             "arguments" };
+        buf += "{\"kind\":\"";
+        buf += kinds[d.kind];
+        buf += "\",\"severity\":\"";
+        buf += d.kind == DIAG_DEFINED ? "trace" : "error";
+        buf += "\",";
+        if (d.what) {
+            buf += "\"what\":\"";
+            buf += d.what;
+            buf += "\",";
+        }
+        buf += "\"name\":";
+        appendJsonString(buf, gNames.spelling(d.name));
+        if (d.kind == DIAG_DEFINED || d.kind == DIAG_TYPE) {
+            buf += ",\"type\":\"";
+            buf += typeToString(d.type);
+            buf += '"';
+        }
+        if (d.kind == DIAG_TYPE) {
+            buf += ",\"expected\":\"";
+            buf += typeToString(d.expected);
+            buf += '"';
+        }
+        buf += ",\"line\":";
+        appendInt(buf, d.line);
+        buf += "}\n";
+    }
+
+    void add(const Diagnostic &d) {
+        if (d.kind != DIAG_DEFINED) ++errors;
+        records.push_back(d);
+        if (out && records.size() >= FlushThreshold) flush();
+    }
+
+public:
+    Diagnostics() {}
+    // A private buffer for one unit of work; its records are handed to the
+    // real engine with splice() so they come out in source order.
+    explicit Diagnostics(bool withTraces) : out(nullptr), traces(withTraces) {}
+    Diagnostics(const Diagnostics&) = delete;
+    Diagnostics& operator=(const Diagnostics&) = delete;
+    ~Diagnostics() { flush(); }
+
+    void setStream(std::ostream &o) { flush(); out = &o; }
+    void setFormat(Format f) { format = f; }
+    // With traces off, "defined variable" records are dropped at the source.
+    void setTraces(bool on) { traces = on; }
+    bool tracesEnabled() const { return traces; }
+
+    void defined(SymbolId name, DecafType type, int line) {
+        if (traces) add(Diagnostic{DIAG_DEFINED, nullptr, name, type, line});
+    }
+    void redeclared(const char *what, SymbolId name, int line) {
+        add(Diagnostic{DIAG_REDECLARED, what, name, TYPE_UNKNOWN, line});
+    }
+    void undeclared(const char *what, SymbolId name, int line) {
+        add(Diagnostic{DIAG_UNDECLARED, what, name, TYPE_UNKNOWN, line});
+    }
+
+    // `what` (with `name`, unless it is empty) has type `found` where
+    // `expected` is required.
+    void mismatch(const char *what, SymbolId name, DecafType found, DecafType expected, int line) {
+        add(Diagnostic{DIAG_TYPE, what, name, found, line, expected});
+    }
+    void arguments(SymbolId name, int line) {
+        add(Diagnostic{DIAG_ARGS, nullptr, name, TYPE_UNKNOWN, line});
+    }
+
+    const std::vector<Diagnostic>& pending() const { return records; }
+    // Errors reported so far, written out or not.
+    size_t errorCount() const { return errors; }
+
+    // Adds a record produced earlier, e.g. replayed from the analysis cache.
+    void replay(const Diagnostic &d) { add(d); }
+
+    // Appends everything `other` collected, in order, and empties it.
+    void splice(Diagnostics &other) {
+        for (const Diagnostic &d : other.records) add(d);
+        other.records.clear();
+    }
+
+    // Renders everything collected so far and hands it to the stream in a
+    // single write.
+    void flush() {
+        if (!out || records.empty()) return;
+        std::string buf;
+        buf.reserve(records.size() * 64);
+        for (const Diagnostic &d : records) {
+            if (format == Json) renderJson(buf, d);
+            else                renderText(buf, d);
+        }
+        records.clear();
+        out->write(buf.data(), buf.size());
+        out->flush();
+    }
+};
+
+extern thread_local Diagnostics gDiag;
+
+#endif // DIAGNOSTICS_H
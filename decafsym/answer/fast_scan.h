@@ -0,0 +1,338 @@
+#ifndef FAST_SCAN_H
+#define FAST_SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define DECAF_SCAN_X86 1
+#endif
+
+// Hand-written scanner for the Decaf token set. Whitespace runs, comments
+// and string literal bodies, which dominate machine-generated sources, are
+// crossed a vector at a time by the kernels below; everything else is
+// ordinary byte-at-a-time code.
+//
+// This is a prototype. Only the benchmark (--bench) runs it, where its tokens
+// are checked against the flex scanner's; compiling still goes through flex.
+// Putting it in front of the parser needs a yylex() that returns decafsym.y's
+// token codes and fills its yylval, which belong to the grammar, not to this
+// file.
+
+// The three loops worth vectorizing. Each returns the first position at or
+// after `p` that stops the loop, or `end`.
+struct ScanKernels {
+    const char *name;
+    // Stops at the first byte that is not whitespace. Adds the newlines it
+    // crosses to `lines` and points `lineStart` just past the last of them.
+    const char* (*skipSpace)(const char *p, const char *end, int &lines, const char *&lineStart);
+    // Stops at '\n' (the end of a // comment).
+    const char* (*findNewline)(const char *p, const char *end);
+    // Stops at '"', '\\' or '\n' inside a string literal.
+    const char* (*findStringStop)(const char *p, const char *end);
+};
+
+namespace scan_detail {
+
+// Decaf whitespace: \a \b \t \n \v \f \r and space.
+inline bool isSpace(unsigned char c) { return c == ' ' || (c >= 7 && c <= 13); }
+
+inline const char* skipSpaceScalar(const char *p, const char *end, int &lines, const char *&lineStart) {
+    for (; p < end && isSpace(*p); ++p) {
+        if (*p == '\n') {
+            ++lines;
+            lineStart = p + 1;
+        }
+    }
+    return p;
+}
+
+inline const char* findNewlineScalar(const char *p, const char *end) {
+    while (p < end && *p != '\n') ++p;
+    return p;
+}
+
+inline const char* findStringStopScalar(const char *p, const char *end) {
+    while (p < end && *p != '"' && *p != '\\' && *p != '\n') ++p;
+    return p;
+}
+
+// Accounts for the newlines among the bytes of a block at `p` whose bits are
+// set in `nl`.
+inline void countLines(const char *p, uint32_t nl, int &lines, const char *&lineStart) {
+    if (!nl) return;
+    lines += __builtin_popcount(nl);
+    lineStart = p + (31 - __builtin_clz(nl)) + 1;
+}
+
+#ifdef DECAF_SCAN_X86
+// Bytes equal to c.
+inline __m128i eq16(__m128i v, char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); }
+
+// Whitespace bytes: space, or 7 <= c <= 13 tested as an unsigned compare of
+// c - 7 against 6, done with signed compares by flipping the top bit.
+inline __m128i space16(__m128i v) {
+    __m128i t = _mm_xor_si128(_mm_sub_epi8(v, _mm_set1_epi8(7)), _mm_set1_epi8(char(0x80)));
+    return _mm_or_si128(_mm_cmplt_epi8(t, _mm_set1_epi8(char(0x80 + 7))), eq16(v, ' '));
+}
+
+inline const char* skipSpaceSse2(const char *p, const char *end, int &lines, const char *&lineStart) {
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        uint32_t ws = _mm_movemask_epi8(space16(v));
+        uint32_t nl = _mm_movemask_epi8(eq16(v, '\n'));
+        if (ws != 0xffff) {
+            unsigned stop = __builtin_ctz(~ws);
+            countLines(p, nl & ((1u << stop) - 1), lines, lineStart);
+            return p + stop;
+        }
+        countLines(p, nl, lines, lineStart);
+    }
+    return skipSpaceScalar(p, end, lines, lineStart);
+}
+
+inline const char* findNewlineSse2(const char *p, const char *end) {
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        if (uint32_t m = _mm_movemask_epi8(eq16(v, '\n'))) return p + __builtin_ctz(m);
+    }
+    return findNewlineScalar(p, end);
+}
+
+inline const char* findStringStopSse2(const char *p, const char *end) {
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i hit = _mm_or_si128(_mm_or_si128(eq16(v, '"'), eq16(v, '\\')), eq16(v, '\n'));
+        if (uint32_t m = _mm_movemask_epi8(hit)) return p + __builtin_ctz(m);
+    }
+    return findStringStopScalar(p, end);
+}
+
+#define DECAF_AVX2 __attribute__((target("avx2")))
+
+DECAF_AVX2 inline __m256i eq32(__m256i v, char c) { return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)); }
+
+DECAF_AVX2 inline __m256i space32(__m256i v) {
+    __m256i t = _mm256_xor_si256(_mm256_sub_epi8(v, _mm256_set1_epi8(7)), _mm256_set1_epi8(char(0x80)));
+    return _mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(char(0x80 + 7)), t), eq32(v, ' '));
+}
+
+DECAF_AVX2 inline const char* skipSpaceAvx2(const char *p, const char *end, int &lines, const char *&lineStart) {
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        uint32_t ws = _mm256_movemask_epi8(space32(v));
+        uint32_t nl = _mm256_movemask_epi8(eq32(v, '\n'));
+        if (ws != 0xffffffffu) {
+            unsigned stop = __builtin_ctz(~ws);
+            countLines(p, nl & ((1u << stop) - 1), lines, lineStart);
+            return p + stop;
+        }
+        countLines(p, nl, lines, lineStart);
+    }
+    return skipSpaceSse2(p, end, lines, lineStart);
+}
+
+DECAF_AVX2 inline const char* findNewlineAvx2(const char *p, const char *end) {
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        if (uint32_t m = _mm256_movemask_epi8(eq32(v, '\n'))) return p + __builtin_ctz(m);
+    }
+    return findNewlineSse2(p, end);
+}
+
+DECAF_AVX2 inline const char* findStringStopAvx2(const char *p, const char *end) {
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(eq32(v, '"'), eq32(v, '\\')), eq32(v, '\n'));
+        if (uint32_t m = _mm256_movemask_epi8(hit)) return p + __builtin_ctz(m);
+    }
+    return findStringStopSse2(p, end);
+}
+
+#undef DECAF_AVX2
+#endif // DECAF_SCAN_X86
+
+} // namespace scan_detail
+
+// Every kernel set this machine can run, plainest first.
+inline const std::vector<ScanKernels>& availableScanKernels() {
+    using namespace scan_detail;
+    static const std::vector<ScanKernels> sets = [] {
+        std::vector<ScanKernels> v;
+        v.push_back(ScanKernels{"scalar", skipSpaceScalar, findNewlineScalar, findStringStopScalar});
+#ifdef DECAF_SCAN_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))
+            v.push_back(ScanKernels{"sse2", skipSpaceSse2, findNewlineSse2, findStringStopSse2});
+        if (__builtin_cpu_supports("avx2"))
+            v.push_back(ScanKernels{"avx2", skipSpaceAvx2, findNewlineAvx2, findStringStopAvx2});
+#endif
+        return v;
+    }();
+    return sets;
+}
+
+// The widest kernel set this machine can run, chosen once.
+inline const ScanKernels& scanKernels() {
+    return availableScanKernels().back();
+}
+
+enum class DecafToken : uint8_t {
+    End, Error,
+    Id, IntConstant, CharConstant, StringConstant,
+    // keywords
+    Bool, Break, Continue, Else, Extern, False, For, Func, If, Int, Null,
+    Package, Return, String, True, Var, Void, While,
+    // punctuation and operators
+    LCB, RCB, LSB, RSB, LParen, RParen, Comma, Semicolon, Assign,
+    Plus, Minus, Mult, Div, Mod, LeftShift, RightShift,
+    Lt, Gt, Leq, Geq, Eq, Neq, And, Or, Not
+};
+
+struct ScannedToken {
+    DecafToken       kind;
+    std::string_view text;     // a view into the scanned buffer
+    int              line;     // lineno when the token starts
+    int              column;   // tokenpos when the token starts
+};
+
+// Tokenizes a buffer in place. lineno counts from 1; tokenpos is the offset
+// of the next byte within its line, so a token's column is tokenpos just
+// before it. Malformed input yields Error tokens and scanning continues.
+class FastScanner {
+    const char *cur, *end, *lineStart;
+    int lineno = 1;
+    const ScanKernels &k;
+
+    static bool isIdStart(unsigned char c) { return unsigned((c | 0x20) - 'a') < 26 || c == '_'; }
+    static bool isDigit(unsigned char c) { return unsigned(c - '0') < 10; }
+    static bool isIdChar(unsigned char c) { return isIdStart(c) || isDigit(c); }
+    static bool isHexDigit(unsigned char c) { return isDigit(c) || unsigned((c | 0x20) - 'a') < 6; }
+    static bool isEscape(char c) { return c && std::strchr("nrtvfab\\'\"", c); }
+
+    static DecafToken keyword(std::string_view s) {
+        struct Entry { const char *text; DecafToken kind; };
+        static const Entry table[] = {
+            {"bool", DecafToken::Bool}, {"break", DecafToken::Break},
+            {"continue", DecafToken::Continue}, {"else", DecafToken::Else},
+            {"extern", DecafToken::Extern}, {"false", DecafToken::False},
+            {"for", DecafToken::For}, {"func", DecafToken::Func}, {"if", DecafToken::If},
+            {"int", DecafToken::Int}, {"null", DecafToken::Null},
+            {"package", DecafToken::Package}, {"return", DecafToken::Return},
+            {"string", DecafToken::String}, {"true", DecafToken::True},
+            {"var", DecafToken::Var}, {"void", DecafToken::Void}, {"while", DecafToken::While},
+        };
+        if (s.size() < 2 || s.size() > 8 || s[0] < 'b' || s[0] > 'w') return DecafToken::Id;
+        for (const Entry &e : table)
+            if (e.text[0] == s[0] && s == e.text) return e.kind;
+        return DecafToken::Id;
+    }
+
+    // `cur` is just past the opening quote.
+    DecafToken stringLiteral() {
+        for (;;) {
+            cur = k.findStringStop(cur, end);
+            if (cur == end || *cur == '\n') return DecafToken::Error;
+            if (*cur == '"') {
+                ++cur;
+                return DecafToken::StringConstant;
+            }
+            if (cur + 1 == end || !isEscape(cur[1])) {
+                ++cur;
+                return DecafToken::Error;
+            }
+            cur += 2;
+        }
+    }
+
+    // `cur` is just past the opening quote.
+    DecafToken charLiteral() {
+        if (cur < end && *cur == '\\') {
+            if (cur + 1 == end || !isEscape(cur[1])) return DecafToken::Error;
+            cur += 2;
+        } else if (cur < end && *cur != '\'' && *cur != '\n') {
+            ++cur;
+        } else {
+            return DecafToken::Error;
+        }
+        if (cur == end || *cur != '\'') return DecafToken::Error;
+        ++cur;
+        return DecafToken::CharConstant;
+    }
+
+    DecafToken op(unsigned char c) {
+        auto next = [this](char x) { return cur < end && *cur == x ? (++cur, true) : false; };
+        switch (c) {
+        case '{': return DecafToken::LCB;
+        case '}': return DecafToken::RCB;
+        case '[': return DecafToken::LSB;
+        case ']': return DecafToken::RSB;
+        case '(': return DecafToken::LParen;
+        case ')': return DecafToken::RParen;
+        case ',': return DecafToken::Comma;
+        case ';': return DecafToken::Semicolon;
+        case '+': return DecafToken::Plus;
+        case '-': return DecafToken::Minus;
+        case '*': return DecafToken::Mult;
+        case '/': return DecafToken::Div;
+        case '%': return DecafToken::Mod;
+        case '=': return next('=') ? DecafToken::Eq : DecafToken::Assign;
+        case '!': return next('=') ? DecafToken::Neq : DecafToken::Not;
+        case '<': return next('<') ? DecafToken::LeftShift : next('=') ? DecafToken::Leq : DecafToken::Lt;
+        case '>': return next('>') ? DecafToken::RightShift : next('=') ? DecafToken::Geq : DecafToken::Gt;
+        case '&': return next('&') ? DecafToken::And : DecafToken::Error;
+        case '|': return next('|') ? DecafToken::Or : DecafToken::Error;
+        default:  return DecafToken::Error;
+        }
+    }
+
+public:
+    explicit FastScanner(std::string_view text, const ScanKernels &kernels = scanKernels())
+        : cur(text.data()), end(text.data() + text.size()), lineStart(text.data()), k(kernels) {}
+
+    int line() const { return lineno; }
+    int tokenpos() const { return int(cur - lineStart); }
+
+    // Fills `t` with the next token; false once the input is exhausted.
+    bool next(ScannedToken &t) {
+        for (;;) {
+            cur = k.skipSpace(cur, end, lineno, lineStart);
+            if (end - cur < 2 || cur[0] != '/' || cur[1] != '/') break;
+            cur = k.findNewline(cur + 2, end);
+        }
+        t.line = lineno;
+        t.column = tokenpos();
+        const char *start = cur;
+        if (cur == end) {
+            t.kind = DecafToken::End;
+            t.text = std::string_view(cur, 0);
+            return false;
+        }
+        unsigned char c = *cur++;
+        if (isIdStart(c)) {
+            while (cur < end && isIdChar(*cur)) ++cur;
+            t.kind = keyword(std::string_view(start, cur - start));
+        } else if (isDigit(c)) {
+            if (c == '0' && end - cur >= 2 && (*cur | 0x20) == 'x' && isHexDigit(cur[1])) {
+                cur += 2;
+                while (cur < end && isHexDigit(*cur)) ++cur;
+            } else {
+                while (cur < end && isDigit(*cur)) ++cur;
+            }
+            t.kind = DecafToken::IntConstant;
+        } else if (c == '"') {
+            t.kind = stringLiteral();
+        } else if (c == '\'') {
+            t.kind = charLiteral();
+        } else {
+            t.kind = op(c);
+        }
+        t.text = std::string_view(start, cur - start);
+        return true;
+    }
+};
+
+#endif // FAST_SCAN_H
@@ -0,0 +1,23 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// 64-bit FNV-1a.
+struct Hasher {
+    uint64_t h = 1469598103934665603ULL;
+
+    void bytes(const void *p, size_t n) {
+        const unsigned char *c = static_cast<const unsigned char*>(p);
+        for (size_t i = 0; i < n; ++i) {
+            h ^= c[i];
+            h *= 1099511628211ULL;
+        }
+    }
+    void str(const std::string &s) { u64(s.size()); bytes(s.data(), s.size()); }
+    void u64(uint64_t v) { bytes(&v, sizeof v); }
+};
+
+#endif // HASH_H
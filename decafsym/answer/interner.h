@@ -0,0 +1,78 @@
+#ifndef INTERNER_H
+#define INTERNER_H
+
+#include <cstdint>
+#include <deque>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "stats.h"
+
+typedef uint32_t SymbolId;
+
+// An id intern() never hands out, spelled "". Used where a SymbolId is
+// required but there is no name (a diagnostic about an unnamed
+// expression); unlike interning "", it means the same in every thread's
+// interner.
+const SymbolId NoName = UINT32_MAX;
+
+// Maps every distinct identifier spelling to a dense 32-bit id. Ids are
+// handed out in first-seen order starting at 0, so tables keyed by name can
+// be plain vectors indexed by SymbolId.
+class Interner {
+    std::deque<std::string>                        spellings; // stable storage
+    std::unordered_map<std::string_view, SymbolId> ids;       // views into spellings
+
+public:
+#ifdef DECAF_STATS
+    InternStats stats;
+#endif
+
+    SymbolId intern(std::string_view name) {
+        DECAF_COUNT(++stats.interns; stats.probes += ids.bucket_size(ids.bucket(name)));
+        auto it = ids.find(name);
+        if (it != ids.end()) return it->second;
+        SymbolId id = spellings.size();
+        spellings.emplace_back(name);
+        ids.emplace(spellings.back(), id);
+        return id;
+    }
+
+    const std::string& spelling(SymbolId id) const {
+        static const std::string none;
+        return id == NoName ? none : spellings[id];
+    }
+
+    size_t size() const { return spellings.size(); }
+
+    // Forgets every name; ids handed out so far become invalid.
+    void clear() {
+        ids.clear();
+        spellings.clear();
+    }
+};
+
+extern thread_local Interner gNames;
+
+// An interned identifier as stored in the AST. Converts from a spelling (the
+// grammar actions pass std::string) or from an id the lexer already interned,
+// and compares as an integer; the spelling is only fetched for printing.
+struct Ident {
+    SymbolId id;
+
+    Ident() : id(0) {}
+    Ident(SymbolId i) : id(i) {}
+    Ident(std::string_view name) : id(gNames.intern(name)) {}
+    Ident(const std::string& name) : id(gNames.intern(name)) {}
+    Ident(const char* name) : id(gNames.intern(name)) {}
+
+    operator SymbolId() const { return id; }
+    const std::string& str() const { return gNames.spelling(id); }
+};
+
+inline std::ostream& operator<<(std::ostream& out, Ident name) {
+    return out << name.str();
+}
+
+#endif // INTERNER_H
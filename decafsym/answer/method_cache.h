@@ -0,0 +1,230 @@
+#ifndef METHOD_CACHE_H
+#define METHOD_CACHE_H
+
+#include <cstdint>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "diagnostics.h"
+#include "hash.h"
+#include "symbol_table.h"
+
+// Stream buffer that hashes what is written to it and keeps nothing.
+class HashBuffer : public std::streambuf {
+    Hasher hasher;
+protected:
+    int overflow(int c) override {
+        char ch = c;
+        hasher.bytes(&ch, 1);
+        return c;
+    }
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        hasher.bytes(s, n);
+        return n;
+    }
+public:
+    uint64_t value() const { return hasher.h; }
+};
+
+// Everything analyzing one method body produced, with nodes named by their
+// position in the method's print-order trace so the entry can be applied to
+// a freshly parsed tree.
+struct MethodCacheEntry {
+    struct Diag {
+        DiagKind    kind;
+        std::string what, name;
+        DecafType   type;
+        int         line;
+        DecafType   expected;
+    };
+    struct Event {
+        ScopeEvent::Op op;
+        uint32_t    node;     // Insert: declaring node; Snapshot: block
+        std::string name;
+        DecafType   type;
+        int         line;
+    };
+    enum Target : uint8_t { Unresolved, Local, Outer };
+    struct Use {
+        uint32_t node;
+        Target   target;
+        uint32_t id;          // Local: ordinal among the Inserts; Outer: DeclId
+        DecafType type;       // what the use node was typed as
+    };
+    struct ArgLine {
+        uint32_t node;
+        int      line;
+    };
+
+    uint32_t             traceSize = 0;
+    std::vector<Diag>    diags;
+    std::vector<Event>   events;
+    std::vector<Use>     uses;
+    std::vector<ArgLine> argLines;
+};
+
+// One file per entry, named by the key, under a cache directory. Entries are
+// written to a temporary name and renamed, so concurrent compilers sharing a
+// directory only ever see complete files.
+class MethodCache {
+    static const uint32_t Version = 3;
+
+    static void put32(std::string &b, uint32_t v) { b.append(reinterpret_cast<char*>(&v), 4); }
+    static void putStr(std::string &b, const std::string &s) { put32(b, s.size()); b += s; }
+
+    struct Reader {
+        const std::string &b;
+        size_t pos = 0;
+        bool ok = true;
+        explicit Reader(const std::string &s) : b(s) {}
+        uint32_t get32() {
+            uint32_t v = 0;
+            if (pos + 4 > b.size()) { ok = false; return 0; }
+            std::memcpy(&v, b.data() + pos, 4);
+            pos += 4;
+            return v;
+        }
+        // An enum no greater than `last`; anything else fails the read.
+        template <class E> E getEnum(E last) {
+            uint32_t v = get32();
+            if (v > uint32_t(last)) { ok = false; v = 0; }
+            return E(v);
+        }
+        // An element count; every element takes at least four bytes, so a
+        // count the rest of the file cannot hold fails the read.
+        uint32_t getCount() {
+            uint32_t n = get32();
+            if (n > (b.size() - pos) / 4) { ok = false; n = 0; }
+            return n;
+        }
+        std::string getStr() {
+            uint32_t n = get32();
+            if (!ok || pos + n > b.size()) { ok = false; return std::string(); }
+            pos += n;
+            return b.substr(pos - n, n);
+        }
+    };
+
+    std::string dir;
+
+    std::string path(uint64_t key) const {
+        char name[32];
+        snprintf(name, sizeof name, "/%016llx.dsc", (unsigned long long)key);
+        return dir + name;
+    }
+
+public:
+    explicit MethodCache(const std::string &d) : dir(d) {}
+
+    // Diagnostic::what must point at a string that outlives the diagnostics;
+    // replayed entries get theirs from this process-wide set.
+    static const char* whatString(const std::string &what) {
+        static std::mutex lock;
+        static std::set<std::string> names;
+        std::lock_guard<std::mutex> guard(lock);
+        return names.insert(what).first->c_str();
+    }
+
+    bool load(uint64_t key, MethodCacheEntry &e) const {
+        std::ifstream f(path(key), std::ios::binary);
+        if (!f) return false;
+        std::ostringstream buf;
+        buf << f.rdbuf();
+        std::string data = buf.str();
+        Reader r(data);
+        if (r.get32() != 0x43534644 || r.get32() != Version) return false;   // "DFSC"
+        e.traceSize = r.get32();
+        e.diags.resize(r.getCount());
+        for (MethodCacheEntry::Diag &d : e.diags) {
+            if (!r.ok) return false;
+            d.kind = r.getEnum(DIAG_ARGS);
+            d.what = r.getStr();
+            d.name = r.getStr();
+            d.type = r.getEnum(TYPE_UNKNOWN);
+            d.line = r.get32();
+            d.expected = r.getEnum(TYPE_UNKNOWN);
+        }
+        e.events.resize(r.getCount());
+        for (MethodCacheEntry::Event &ev : e.events) {
+            if (!r.ok) return false;
+            ev.op = r.getEnum(ScopeEvent::Snapshot);
+            ev.node = r.get32();
+            ev.name = r.getStr();
+            ev.type = r.getEnum(TYPE_UNKNOWN);
+            ev.line = r.get32();
+        }
+        e.uses.resize(r.getCount());
+        for (MethodCacheEntry::Use &u : e.uses) {
+            if (!r.ok) return false;
+            u.node = r.get32();
+            u.target = r.getEnum(MethodCacheEntry::Outer);
+            u.id = r.get32();
+            u.type = r.getEnum(TYPE_UNKNOWN);
+        }
+        e.argLines.resize(r.getCount());
+        for (MethodCacheEntry::ArgLine &a : e.argLines) {
+            if (!r.ok) return false;
+            a.node = r.get32();
+            a.line = r.get32();
+        }
+        return r.ok && r.pos == data.size() && valid(e);
+    }
+
+    // Whether every node index falls inside the trace. A damaged or foreign
+    // file can pass the header check, and replay indexes the trace with these.
+    static bool valid(const MethodCacheEntry &e) {
+        for (const MethodCacheEntry::Event &ev : e.events)
+            if (ev.node != ~0u && ev.node >= e.traceSize) return false;
+        for (const MethodCacheEntry::Use &u : e.uses)
+            if (u.node >= e.traceSize) return false;
+        for (const MethodCacheEntry::ArgLine &a : e.argLines)
+            if (a.node >= e.traceSize) return false;
+        return true;
+    }
+
+    // Removes the entry for `key`, if there is one.
+    void drop(uint64_t key) const { std::remove(path(key).c_str()); }
+
+    void store(uint64_t key, const MethodCacheEntry &e) const {
+        std::string b;
+        put32(b, 0x43534644);
+        put32(b, Version);
+        put32(b, e.traceSize);
+        put32(b, e.diags.size());
+        for (const MethodCacheEntry::Diag &d : e.diags) {
+            put32(b, d.kind); putStr(b, d.what); putStr(b, d.name);
+            put32(b, d.type); put32(b, d.line); put32(b, d.expected);
+        }
+        put32(b, e.events.size());
+        for (const MethodCacheEntry::Event &ev : e.events) {
+            put32(b, ev.op); put32(b, ev.node); putStr(b, ev.name);
+            put32(b, ev.type); put32(b, ev.line);
+        }
+        put32(b, e.uses.size());
+        for (const MethodCacheEntry::Use &u : e.uses) {
+            put32(b, u.node); put32(b, u.target); put32(b, u.id); put32(b, u.type);
+        }
+        put32(b, e.argLines.size());
+        for (const MethodCacheEntry::ArgLine &a : e.argLines) {
+            put32(b, a.node); put32(b, a.line);
+        }
+        std::string final = path(key);
+        static std::atomic<unsigned> serial(0);
+        std::string tmp = final + ".tmp" + std::to_string(getpid()) + "." + std::to_string(serial++);
+        {
+            std::ofstream f(tmp, std::ios::binary);
+            if (!f.write(b.data(), b.size())) return;
+        }
+        std::rename(tmp.c_str(), final.c_str());
+    }
+};
+
+#endif // METHOD_CACHE_H
@@ -0,0 +1,128 @@
+#ifndef PERSISTENT_SCOPE_H
+#define PERSISTENT_SCOPE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "arena.h"
+#include "interner.h"
+
+struct DeclInfo;
+
+// Immutable map from name to the declaration in scope, as a hash array
+// mapped trie keyed directly on the (already dense) SymbolId, five bits per
+// level. with() copies only the path to the changed slot and shares the rest,
+// so keeping a snapshot is O(1) and each declaration costs O(log32 n) new
+// nodes. Nodes live in an Arena and are never freed individually.
+class ScopeSnapshot {
+    struct Leaf {
+        SymbolId        key;
+        const DeclInfo *decl;
+    };
+    struct Node {
+        uint32_t    bitmap;    // slots present
+        uint32_t    leaves;    // which present slots hold a Leaf
+        const void *slots[1];  // popcount(bitmap) entries, Leaf* or Node*
+    };
+
+    const Node *root = nullptr;
+
+    explicit ScopeSnapshot(const Node *r) : root(r) {}
+
+    static Node* newNode(Arena &a, int n) {
+        size_t size = offsetof(Node, slots) + (n ? n : 1) * sizeof(const void*);
+        return static_cast<Node*>(a.allocate(size, alignof(Node)));
+    }
+
+    static const Leaf* newLeaf(Arena &a, SymbolId key, const DeclInfo *decl) {
+        Leaf *l = static_cast<Leaf*>(a.allocate(sizeof(Leaf), alignof(Leaf)));
+        l->key = key;
+        l->decl = decl;
+        return l;
+    }
+
+    static int slotIndex(uint32_t bitmap, uint32_t bit) {
+        return __builtin_popcount(bitmap & (bit - 1));
+    }
+
+    // Copy of `n` with the slot for `bit` set to `p`, inserted if absent.
+    static const Node* copyWith(Arena &a, const Node *n, uint32_t bit, const void *p, bool leaf) {
+        uint32_t bitmap = n ? n->bitmap : 0;
+        int count = __builtin_popcount(bitmap);
+        int idx = slotIndex(bitmap, bit);
+        bool present = bitmap & bit;
+        Node *c = newNode(a, count + !present);
+        c->bitmap = bitmap | bit;
+        c->leaves = ((n ? n->leaves : 0) & ~bit) | (leaf ? bit : 0);
+        if (n) std::memcpy(c->slots, n->slots, idx * sizeof(const void*));
+        c->slots[idx] = p;
+        if (n) std::memcpy(c->slots + idx + 1, n->slots + idx + present,
+                           (count - idx - present) * sizeof(const void*));
+        return c;
+    }
+
+    static const Node* insert(Arena &a, const Node *n, const Leaf *leaf, int shift) {
+        uint32_t bit = 1u << ((leaf->key >> shift) & 31);
+        if (!n || !(n->bitmap & bit)) return copyWith(a, n, bit, leaf, true);
+        const void *slot = n->slots[slotIndex(n->bitmap, bit)];
+        if (!(n->leaves & bit))
+            return copyWith(a, n, bit, insert(a, static_cast<const Node*>(slot), leaf, shift + 5), false);
+        const Leaf *old = static_cast<const Leaf*>(slot);
+        if (old->key == leaf->key) return copyWith(a, n, bit, leaf, true);
+        // two names share this slot: push both one level down
+        const Node *sub = insert(a, insert(a, nullptr, old, shift + 5), leaf, shift + 5);
+        return copyWith(a, n, bit, sub, false);
+    }
+
+    template <class Fn>
+    static void each(const Node *n, Fn &fn) {
+        int i = 0;
+        for (uint32_t m = n->bitmap; m; m &= m - 1, ++i) {
+            uint32_t bit = m & -m;
+            if (n->leaves & bit) {
+                const Leaf *l = static_cast<const Leaf*>(n->slots[i]);
+                fn(l->key, l->decl);
+            } else {
+                each(static_cast<const Node*>(n->slots[i]), fn);
+            }
+        }
+    }
+
+public:
+    ScopeSnapshot() {}
+
+    bool empty() const { return root == nullptr; }
+
+    // The declaration `name` resolves to here, or null.
+    const DeclInfo* lookup(SymbolId name) const {
+        const Node *n = root;
+        for (int shift = 0; n; shift += 5) {
+            uint32_t bit = 1u << ((name >> shift) & 31);
+            if (!(n->bitmap & bit)) return nullptr;
+            const void *slot = n->slots[slotIndex(n->bitmap, bit)];
+            if (n->leaves & bit) {
+                const Leaf *l = static_cast<const Leaf*>(slot);
+                return l->key == name ? l->decl : nullptr;
+            }
+            n = static_cast<const Node*>(slot);
+        }
+        return nullptr;
+    }
+
+    // This snapshot plus `name` bound to `decl`, replacing (shadowing) any
+    // earlier binding of the name. `this` is unchanged.
+    ScopeSnapshot with(SymbolId name, const DeclInfo *decl, Arena &a) const {
+        return ScopeSnapshot(insert(a, root, newLeaf(a, name, decl), 0));
+    }
+
+    // Calls fn(name, decl) for every visible name, in no particular order.
+    template <class Fn>
+    void forEach(Fn fn) const {
+        if (root) each(root, fn);
+    }
+
+    bool operator==(const ScopeSnapshot &o) const { return root == o.root; }
+    bool operator!=(const ScopeSnapshot &o) const { return root != o.root; }
+};
+
+#endif // PERSISTENT_SCOPE_H
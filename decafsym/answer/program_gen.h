@@ -0,0 +1,161 @@
+#ifndef PROGRAM_GEN_H
+#define PROGRAM_GEN_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Shape of a synthetic Decaf program for the benchmark. Every method body is
+// a chain of `depth` nested blocks; each block declares `varsPerBlock`
+// variables, of which `shadowPercent` reuse a name that is already visible.
+struct GenConfig {
+    int      fields = 100;
+    int      methods = 50;
+    int      depth = 6;
+    int      varsPerBlock = 3;
+    int      shadowPercent = 30;
+    int      exprLength = 8;     // operands in every assignment
+    int      callSites = 4;      // calls per block
+    int      comments = 0;       // // comment lines per block
+    int      strings = 0;        // print_string calls per block
+    uint64_t seed = 1;
+};
+
+// Deterministic across platforms and standard libraries (splitmix64), so a
+// given config always produces the same program.
+class GenRandom {
+    uint64_t state;
+public:
+    explicit GenRandom(uint64_t seed) : state(seed) {}
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+    int below(int n) { return n > 0 ? int(next() % uint64_t(n)) : 0; }
+    bool percent(int p) { return below(100) < p; }
+};
+
+class ProgramGenerator {
+    const GenConfig &cfg;
+    GenRandom rng;
+    std::string out;
+    int lines = 0;
+    int fresh = 0;                        // counter for new local names
+    std::vector<std::string> visible;     // int names in scope, outermost first
+
+    void line(int indent, const std::string &text) {
+        out.append(indent * 4, ' ');
+        out += text;
+        out += '\n';
+        ++lines;
+    }
+
+    std::string operand() {
+        if (visible.empty() || rng.below(4) == 0) return std::to_string(rng.below(100));
+        return visible[rng.below(visible.size())];
+    }
+
+    std::string expr() {
+        static const char *const ops[] = { " + ", " - ", " * ", " / ", " % " };
+        std::string e = operand();
+        for (int i = 1; i < cfg.exprLength; ++i) {
+            e += ops[rng.below(5)];
+            e += operand();
+        }
+        return e;
+    }
+
+    void call(int indent, int self) {
+        // only earlier methods, so the call graph is acyclic
+        int target = rng.below(self + 1);
+        if (target == self) {
+            line(indent, "print_int(" + expr() + ");");
+        } else {
+            line(indent, "m" + std::to_string(target) + "(" + expr() + ", " +
+                         (rng.below(2) ? "true" : "false") + ");");
+        }
+    }
+
+    // Prose with the odd escape, about 60 bytes.
+    std::string literal() {
+        static const char *const words[] = { "value", "of", "the", "counter", "is", "now", "\\t",
+                                             "\\\"done\\\"", "\\n" };
+        std::string s;
+        while (s.size() < 60) {
+            if (!s.empty()) s += ' ';
+            s += words[rng.below(9)];
+        }
+        return s;
+    }
+
+    void block(int indent, int level, int self) {
+        size_t mark = visible.size();
+        std::string names;
+        for (int i = 0; i < cfg.varsPerBlock; ++i) {
+            std::string name;
+            if (mark > 0 && rng.percent(cfg.shadowPercent)) {
+                // shadow an outer name, unless this block already did
+                name = visible[rng.below(mark)];
+                for (size_t j = mark; j < visible.size(); ++j)
+                    if (visible[j] == name) name.clear();
+            }
+            if (name.empty()) name = "v" + std::to_string(fresh++);
+            names += (i ? ", " : "") + name;
+            visible.push_back(name);
+        }
+        if (!names.empty()) line(indent, "var " + names + " int;");
+        for (int i = 0; i < cfg.comments; ++i)
+            line(indent, "// generated block " + std::to_string(level) + ", comment " +
+                         std::to_string(i) + ": " + literal());
+        for (int i = 0; i < cfg.strings; ++i)
+            line(indent, "print_string(\"" + literal() + "\");");
+        for (size_t i = mark; i < visible.size(); ++i)
+            line(indent, visible[i] + " = " + expr() + ";");
+        for (int i = 0; i < cfg.callSites; ++i) call(indent, self);
+        if (level + 1 < cfg.depth) {
+            line(indent, "{");
+            block(indent + 1, level + 1, self);
+            line(indent, "}");
+        }
+        visible.resize(mark);
+    }
+
+public:
+    explicit ProgramGenerator(const GenConfig &c) : cfg(c), rng(c.seed) {}
+
+    std::string generate() {
+        out.clear();
+        lines = 0;
+        fresh = 0;
+        rng = GenRandom(cfg.seed);
+        line(0, "extern func print_int(int) void;");
+        if (cfg.strings > 0) line(0, "extern func print_string(string) void;");
+        line(0, "package Bench {");
+        for (int i = 0; i < cfg.fields; ++i) {
+            std::string name = "f" + std::to_string(i);
+            line(1, "var " + name + " int;");
+            visible.push_back(name);
+        }
+        for (int m = 0; m < cfg.methods; ++m) {
+            line(1, "func m" + std::to_string(m) + "(a int, b bool) int {");
+            visible.push_back("a");
+            block(2, 0, m);
+            line(2, "return a;");
+            visible.pop_back();
+            line(1, "}");
+        }
+        line(1, "func main() int {");
+        for (int m = 0; m < cfg.methods; ++m)
+            line(2, "m" + std::to_string(m) + "(" + std::to_string(m) + ", true);");
+        line(1, "}");
+        line(0, "}");
+        visible.clear();
+        return out;
+    }
+
+    int numLines() const { return lines; }
+};
+
+#endif // PROGRAM_GEN_H
@@ -0,0 +1,193 @@
+/* Calls/sec of the runtime's print_int, print_string and read_int against
+   the printf/scanf versions it replaced, with stdout sent to /dev/null and
+   stdin read from a temporary file. Both sides are first run over the same
+   values and their output and results compared byte for byte.
+
+   usage: runtime-bench [calls] */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+
+#include "decaf-stdlib.c"
+
+static void stdio_print_int(int x) { printf("%d", x); }
+static void stdio_print_string(const char *s) { printf("%s", s); }
+static int stdio_read_int() {
+  int i;
+  scanf("%d", &i);
+  return i;
+}
+
+static const char *const strings[] = { "", " ", "\n", "hello, world", "x = ", "-",
+                                       "a somewhat longer line of program output\n" };
+#define NSTRINGS (sizeof strings / sizeof strings[0])
+
+static unsigned seed = 12345;
+static int next_int(void) {
+  seed = seed * 1103515245u + 12345u;
+  switch (seed >> 29) {
+  case 0: return (int)(seed >> 8) % 10;
+  case 1: return -(int)((seed >> 8) % 1000);
+  case 2: return (int)seed;
+  default: return (int)(seed >> 12) - (1 << 19);
+  }
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int saved_stdout;
+
+static void redirect_stdout(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  fflush(stdout);
+  dup2(fd, 1);
+  close(fd);
+  decaf_tty = isatty(1);
+}
+
+static void restore_stdout(void) {
+  fflush(stdout);
+  decaf_flush();
+  dup2(saved_stdout, 1);
+}
+
+static char *slurp(const char *path, size_t *size) {
+  FILE *f = fopen(path, "rb");
+  char *text;
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  rewind(f);
+  text = malloc(*size + 1);
+  *size = fread(text, 1, *size, f);
+  fclose(f);
+  return text;
+}
+
+/* Writes the same calls through both implementations and compares. */
+static int check_output(const char *dir) {
+  static const int edges[] = { 0, 1, -1, 9, 10, 99, 100, -100, 65535, INT_MAX, INT_MIN, INT_MIN + 1 };
+  char pa[256], pb[256];
+  size_t na, nb;
+  char *a, *b;
+  unsigned i;
+  int same;
+  snprintf(pa, sizeof pa, "%s/stdio.out", dir);
+  snprintf(pb, sizeof pb, "%s/runtime.out", dir);
+  for (int pass = 0; pass < 2; ++pass) {
+    redirect_stdout(pass ? pb : pa);
+    seed = 1;
+    for (i = 0; i < sizeof edges / sizeof edges[0]; ++i) {
+      if (pass) print_int(edges[i]), print_string(" ");
+      else stdio_print_int(edges[i]), stdio_print_string(" ");
+    }
+    for (i = 0; i < 200000; ++i) {
+      int x = next_int();
+      const char *s = strings[i % NSTRINGS];
+      if (pass) print_int(x), print_string(s);
+      else stdio_print_int(x), stdio_print_string(s);
+    }
+    restore_stdout();
+  }
+  a = slurp(pa, &na);
+  b = slurp(pb, &nb);
+  same = na == nb && memcmp(a, b, na) == 0;
+  free(a);
+  free(b);
+  unlink(pa);
+  unlink(pb);
+  return same;
+}
+
+/* Fills `path` with `n` integers separated by assorted white space. */
+static void write_input(const char *path, long n) {
+  static const char *const gaps[] = { " ", "\n", "  ", "\t", "\r\n" };
+  FILE *f = fopen(path, "w");
+  seed = 7;
+  for (long i = 0; i < n; ++i) {
+    int x = next_int();
+    if (x > 0 && (i & 15) == 0) fputc('+', f);
+    fprintf(f, "%d%s", x, gaps[i % 5]);
+  }
+  fclose(f);
+}
+
+static int check_input(const char *path, long n) {
+  int *want = malloc(n * sizeof *want), ok = 1;
+  long i;
+  freopen(path, "r", stdin);
+  for (i = 0; i < n; ++i) want[i] = stdio_read_int();
+  freopen(path, "r", stdin);
+  for (i = 0; i < n && ok; ++i) ok = read_int() == want[i];
+  free(want);
+  return ok;
+}
+
+static void report(const char *name, long calls, double stdio, double runtime) {
+  printf("  %-14s %14.0f %14.0f %8.2fx\n", name, calls / stdio, calls / runtime, stdio / runtime);
+}
+
+int main(int argc, char **argv) {
+  long calls = argc > 1 ? atol(argv[1]) : 10000000;
+  char dir[] = "/tmp/runtime-benchXXXXXX", input[256];
+  double t0, t1, t2;
+  long i;
+  volatile int sink = 0;
+  int out_ok, in_ok;
+
+  if (calls <= 0 || !mkdtemp(dir)) {
+    fprintf(stderr, "usage: runtime-bench [calls]\n");
+    return 2;
+  }
+  saved_stdout = dup(1);
+  out_ok = check_output(dir);
+  snprintf(input, sizeof input, "%s/input", dir);
+  write_input(input, calls);
+  in_ok = check_input(input, calls < 1000000 ? calls : 1000000);
+
+  printf("%ld calls each; output %s, read_int %s\n\n", calls,
+         out_ok ? "matches printf" : "DIFFERS from printf",
+         in_ok ? "matches scanf" : "DIFFERS from scanf");
+  printf("  %-14s %14s %14s %9s\n", "call", "stdio/sec", "runtime/sec", "speedup");
+
+  redirect_stdout("/dev/null");
+  seed = 3;
+  t0 = now();
+  for (i = 0; i < calls; ++i) stdio_print_int(next_int());
+  fflush(stdout);
+  t1 = now();
+  seed = 3;
+  for (i = 0; i < calls; ++i) print_int(next_int());
+  decaf_flush();
+  t2 = now();
+  restore_stdout();
+  report("print_int", calls, t1 - t0, t2 - t1);
+
+  redirect_stdout("/dev/null");
+  t0 = now();
+  for (i = 0; i < calls; ++i) stdio_print_string(strings[i % NSTRINGS]);
+  fflush(stdout);
+  t1 = now();
+  for (i = 0; i < calls; ++i) print_string(strings[i % NSTRINGS]);
+  decaf_flush();
+  t2 = now();
+  restore_stdout();
+  report("print_string", calls, t1 - t0, t2 - t1);
+
+  freopen(input, "r", stdin);
+  t0 = now();
+  for (i = 0; i < calls; ++i) sink += stdio_read_int();
+  t1 = now();
+  freopen(input, "r", stdin);
+  for (i = 0; i < calls; ++i) sink += read_int();
+  t2 = now();
+  report("read_int", calls, t1 - t0, t2 - t1);
+
+  unlink(input);
+  rmdir(dir);
+  return out_ok && in_ok ? 0 : 1;
+}
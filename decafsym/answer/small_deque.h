@@ -0,0 +1,98 @@
+#ifndef SMALL_DEQUE_H
+#define SMALL_DEQUE_H
+
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include "arena.h"
+
+// Contiguous sequence of trivially copyable values with amortized O(1)
+// insertion at both ends. The first N elements live inline; beyond that the
+// buffer moves to gArena, keeping slack on both sides so the grammar's
+// push_front and push_back actions never shift more than they copy.
+template <class T, size_t N>
+class SmallDeque {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "SmallDeque copies elements with memcpy");
+
+    T      inlineBuf[N];
+    T     *buf = inlineBuf;
+    size_t cap = N;
+    size_t head = 0;   // index of the first element in buf
+    size_t count = 0;
+
+    // Moves the elements into a larger buffer with room for `extra` more at
+    // the front or the back; any remaining slack is split between the ends.
+    void grow(size_t extra, bool atFront) {
+        size_t newCap = cap * 2;
+        if (newCap < count + extra) newCap = count + extra;
+        T *nb = gArena.allocateArray<T>(newCap);
+        size_t spare = newCap - count - extra;
+        size_t newHead = spare / 2 + (atFront ? extra : 0);
+        if (count) std::memcpy(nb + newHead, buf + head, count * sizeof(T));
+        buf = nb;
+        cap = newCap;
+        head = newHead;
+    }
+
+public:
+    SmallDeque() {}
+    SmallDeque(const SmallDeque&) = delete;
+    SmallDeque& operator=(const SmallDeque&) = delete;
+
+    typedef T*       iterator;
+    typedef const T* const_iterator;
+
+    iterator begin() { return buf + head; }
+    iterator end() { return buf + head + count; }
+    const_iterator begin() const { return buf + head; }
+    const_iterator end() const { return buf + head + count; }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T& operator[](size_t i) { return buf[head + i]; }
+    const T& operator[](size_t i) const { return buf[head + i]; }
+    T& front() { return buf[head]; }
+    T& back() { return buf[head + count - 1]; }
+
+    void push_back(const T &v) {
+        if (head + count == cap) {
+            if (head > 0 && count < cap / 2) {
+                // plenty of room at the front; recentre instead of growing
+                size_t newHead = (cap - count) / 2;
+                std::memmove(buf + newHead, buf + head, count * sizeof(T));
+                head = newHead;
+            } else {
+                grow(1, false);
+            }
+        }
+        buf[head + count++] = v;
+    }
+
+    void push_front(const T &v) {
+        if (head == 0) {
+            if (count < cap / 2) {
+                size_t newHead = (cap - count + 1) / 2;
+                std::memmove(buf + newHead, buf, count * sizeof(T));
+                head = newHead;
+            } else {
+                grow(1, true);
+            }
+        }
+        buf[--head] = v;
+        ++count;
+    }
+
+    // Appends all of `other` and leaves it empty.
+    void splice_back(SmallDeque &other) {
+        if (other.count == 0) return;
+        if (cap - head - count < other.count) grow(other.count, false);
+        std::memcpy(buf + head + count, other.buf + other.head, other.count * sizeof(T));
+        count += other.count;
+        other.clear();
+    }
+
+    void clear() { head = 0; count = 0; }
+};
+
+#endif // SMALL_DEQUE_H
@@ -0,0 +1,68 @@
+#ifndef SOURCE_BUFFER_H
+#define SOURCE_BUFFER_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A source file mapped copy-on-write and followed by two NUL bytes, the form
+// flex's yy_scan_buffer() scans in place. The scanner briefly writes a NUL
+// after each token, which only copies the pages it touches. Token values can
+// then be views into the buffer instead of copies, valid for as long as the
+// buffer is alive; pages past the end of the file come from an anonymous
+// mapping, so the padding costs no copy either.
+class SourceBuffer {
+    char  *base = nullptr;
+    size_t len = 0;
+    size_t mapped = 0;
+
+public:
+    explicit SourceBuffer(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            len = st.st_size;
+            mapped = (len + 2 + page - 1) / page * page;
+            void *p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p != MAP_FAILED) {
+                base = static_cast<char*>(p);
+                if (len && mmap(base, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+                    munmap(base, mapped);
+                    base = nullptr;
+                }
+            }
+        }
+        close(fd);
+    }
+    // The same layout holding a copy of `text`, for sources that are not
+    // files (the benchmark's generated program).
+    explicit SourceBuffer(std::string_view text) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        len = text.size();
+        mapped = (len + 2 + page - 1) / page * page;
+        void *p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return;
+        base = static_cast<char*>(p);
+        text.copy(base, len);
+    }
+    SourceBuffer(const SourceBuffer&) = delete;
+    SourceBuffer& operator=(const SourceBuffer&) = delete;
+    ~SourceBuffer() { if (base) munmap(base, mapped); }
+
+    bool ok() const { return base != nullptr; }
+    // The text, without the padding.
+    char* data() const { return base; }
+    size_t size() const { return len; }
+
+    bool contains(std::string_view s) const {
+        return base && s.data() >= base && s.data() + s.size() <= base + len;
+    }
+};
+
+#endif // SOURCE_BUFFER_H
@@ -0,0 +1,52 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+
+// Counters behind --stats. They are only compiled in with -DDECAF_STATS
+// (make STATS=1); otherwise DECAF_COUNT() expands to an empty statement and
+// the counted structures carry no extra fields.
+#ifdef DECAF_STATS
+#define DECAF_COUNT(...) do { __VA_ARGS__; } while (0)
+#else
+#define DECAF_COUNT(...) do {} while (0)
+#endif
+
+struct SymbolStats {
+    uint64_t pushes = 0;
+    uint64_t pops = 0;
+    uint64_t lookups = 0;
+    uint64_t scopesWalked = 0;      // summed over all lookups
+    uint64_t maxScopesWalked = 0;
+    uint64_t inserts = 0;
+    uint64_t insertCollisions = 0;  // name already bound: shadowing or redeclaration
+
+    // A lookup that had to look through `n` scopes, the innermost included,
+    // before it found the name or ran out of scopes.
+    void walked(uint64_t n) {
+        scopesWalked += n;
+        if (n > maxScopesWalked) maxScopesWalked = n;
+    }
+
+    void add(const SymbolStats &o) {
+        pushes += o.pushes;
+        pops += o.pops;
+        lookups += o.lookups;
+        scopesWalked += o.scopesWalked;
+        if (o.maxScopesWalked > maxScopesWalked) maxScopesWalked = o.maxScopesWalked;
+        inserts += o.inserts;
+        insertCollisions += o.insertCollisions;
+    }
+};
+
+struct InternStats {
+    uint64_t interns = 0;  // hash table lookups
+    uint64_t probes = 0;   // entries in the buckets those lookups landed in
+
+    void add(const InternStats &o) {
+        interns += o.interns;
+        probes += o.probes;
+    }
+};
+
+#endif // STATS_H
@@ -1,10 +1,14 @@
 #ifndef SYMBOLTABLE_H
 #define SYMBOLTABLE_H
 
+#include <cstdint>
+#include <deque>
 #include <string>
-#include <unordered_map>
 #include <vector>
 #include <iostream>
+#include "interner.h"
+#include "stats.h"
+#include "persistent_scope.h"
 
 
 enum DecafType {
@@ -26,81 +30,283 @@ inline std::string typeToString(DecafType type) {
 }
 
 
+// Index into a BindingTable; stable for the whole compilation.
+typedef uint32_t DeclId;
+const DeclId NoDecl = ~DeclId(0);
+
 struct SymDescriptor {
-    std::string name;
+    SymbolId    name;
     DecafType   type;
     int         lineDeclared;
+    DeclId      id;
 
-    SymDescriptor() : name(""), type(TYPE_UNKNOWN), lineDeclared(-1) {}
+    SymDescriptor() : name(0), type(TYPE_UNKNOWN), lineDeclared(-1), id(NoDecl) {}
 
-    SymDescriptor(std::string n, DecafType t, int line)
-        : name(std::move(n)), type(t), lineDeclared(line) {}
+    SymDescriptor(SymbolId n, DecafType t, int line, DeclId i = NoDecl)
+        : name(n), type(t), lineDeclared(line), id(i) {}
 };
 
+class decafAST;
 
+struct DeclInfo {
+    decafAST   *node;    // the declaring node
+    SymbolId    name;
+    DecafType   type;
+    int         line;
+    int         depth;   // scope depth, 0 = outermost
+    int         slot;    // position among the declarations of its scope
+    DeclId      id;      // this entry's index in the table
+};
 
-
-class SymbolTable {
-    std::unordered_map<std::string, SymDescriptor> table;
+// Every declaration the analysis entered, in a dense table that outlives the
+// scopes. Uses store the DeclId they resolved to, so later passes go
+// straight to the declaration instead of rebuilding scopes. Entries never
+// move, so scope snapshots can point at them.
+//
+// A table with a nonzero base hands out provisional ids (base + index) and
+// remembers every use that stored one; splice() renumbers those uses and the
+// entries themselves when it appends the table to the real one.
+class BindingTable {
+    std::deque<DeclInfo>               own;     // entries added here
+    std::deque<std::deque<DeclInfo>>   adopted; // storage taken over by splice()
+    std::vector<DeclInfo*>             decls;   // id - base -> entry
+    std::vector<DeclId*>               uses;    // provisional ids to renumber
+    DeclId                             base;
 
 public:
-    bool insert(const std::string &name, DecafType type, int line) {
-        if (table.count(name)) return false;  
-        table[name] = SymDescriptor(name, type, line);
-        return true;
+    explicit BindingTable(DeclId b = 0) : base(b) {}
+    BindingTable(const BindingTable&) = delete;
+    BindingTable& operator=(const BindingTable&) = delete;
+
+    const DeclInfo* add(const DeclInfo &d) {
+        own.push_back(d);
+        own.back().id = base + decls.size();
+        decls.push_back(&own.back());
+        return &own.back();
     }
 
-    SymDescriptor* lookup(const std::string &name) {
-        if (table.count(name)) return &table[name];
-        return nullptr;
+    // `ref` now holds the id of what a use resolved to.
+    void noteUse(DeclId *ref) {
+        if (base && *ref != NoDecl && *ref >= base) uses.push_back(ref);
     }
 
-    void print() const {
-        for (const auto &pair : table) {
-            std::cout << "  " << pair.first << " : "
-                      << typeToString(pair.second.type)
-                      << " (declared on line " << pair.second.lineDeclared << ")\n";
+    const DeclInfo& operator[](DeclId id) const { return *decls[id - base]; }
+    bool contains(DeclId id) const { return id >= base && id - base < decls.size(); }
+    size_t size() const { return decls.size(); }
+
+    void splice(BindingTable &other) {
+        DeclId offset = base + decls.size();
+        for (DeclInfo *d : other.decls) {
+            d->id = d->id - other.base + offset;
+            decls.push_back(d);
         }
+        for (DeclId *ref : other.uses) {
+            *ref = *ref - other.base + offset;
+            noteUse(ref);
+        }
+        // moving a deque hands over its blocks, so the entries stay put
+        adopted.push_back(std::move(other.own));
+        for (std::deque<DeclInfo> &d : other.adopted) adopted.push_back(std::move(d));
+        other.clear();
     }
-};
 
+    void clear() {
+        own.clear();
+        adopted.clear();
+        decls.clear();
+        uses.clear();
+    }
+};
 
+// A scope operation, as logged for the analysis cache (see setLog()).
+struct ScopeEvent {
+    enum Op : uint8_t { Push, Pop, Insert, Snapshot };
+    Op          op;
+    decafAST   *node;    // Insert: declaring node; Snapshot: block taking it
+    SymbolId    name;
+    DecafType   type;
+    int         line;
+};
 
+// Every scope shares one table indexed by interned identifier. Each entry
+// heads a shadow chain through `bindings`, which doubles as the undo log:
+// push() records where the current scope starts and pop() unwinds back to
+// it, restoring whatever each popped declaration had shadowed.
 class SymbolStack {
-    std::vector<SymbolTable> scopes;
+    struct Binding {
+        SymDescriptor desc;
+        int           shadowed;  // previous binding of the name, or -1
+        int           depth;     // scope the binding was declared in
+    };
+
+    std::vector<int>    heads;     // SymbolId -> innermost binding, or -1
+    std::deque<Binding> bindings;  // deque keeps SymDescriptor* stable
+    std::vector<int>    scopeStart;
+
+    // Persistent copy of everything visible, kept while snapshots are
+    // enabled and a table is attached; push() saves it and pop() restores it.
+    ScopeSnapshot              env;
+    std::vector<ScopeSnapshot> envStack;
+    Arena                     *envArena = nullptr;   // null: no snapshots
+
+    // Read-only enclosing stack consulted when a name is not bound here; only
+    // its first `outerLimit` bindings are visible.
+    SymbolStack *outer = nullptr;
+    int          outerLimit = 0;
+    int          depthBase = 0;   // scopes of `outer`, for DeclInfo::depth
+
+    BindingTable *table = nullptr;
+    std::vector<ScopeEvent> *log = nullptr;
 
 public:
+#ifdef DECAF_STATS
+    SymbolStats stats;
+#endif
+
+    // Layers this stack over `parent` as it stood when it held `limit`
+    // bindings (see size()). The parent must not change while attached.
+    void setOuter(SymbolStack *parent, int limit, ScopeSnapshot parentEnv = ScopeSnapshot()) {
+        outer = parent;
+        outerLimit = limit;
+        depthBase = parent->scopeStart.size();
+        env = parentEnv;
+    }
+
+    // Successful inserts are recorded in `t` from now on.
+    void setTable(BindingTable *t) { table = t; }
+    BindingTable* bindingTable() const { return table; }
+
+    // Appends every push, pop, successful insert and snapshotFor() to `l`, so
+    // the same scopes can be rebuilt later without walking the tree.
+    void setLog(std::vector<ScopeEvent> *l) { log = l; }
+
+    // Maintains snapshot() from now on, allocating its nodes from `a`, which
+    // must outlive every snapshot taken; null stops maintaining it. Off by
+    // default, since every insert then builds trie nodes. Set while no
+    // scope is open.
+    void enableSnapshots(Arena *a) { envArena = a; }
+    bool snapshotsEnabled() const { return envArena != nullptr; }
+
+    // Everything visible right now, in O(1). Only maintained while snapshots
+    // are enabled and a BindingTable is attached; empty otherwise.
+    ScopeSnapshot snapshot() const { return env; }
+
+    // snapshot() taken on entry to `block`.
+    ScopeSnapshot snapshotFor(decafAST *block) {
+        if (log) log->push_back(ScopeEvent{ScopeEvent::Snapshot, block, 0, TYPE_UNKNOWN, 0});
+        return env;
+    }
+
+    // Number of live bindings across all scopes.
+    int size() const { return bindings.size(); }
+
     void push() {
-        scopes.push_back(SymbolTable());
+        DECAF_COUNT(++stats.pushes);
+        scopeStart.push_back(bindings.size());
+        if (envArena) envStack.push_back(env);
+        if (log) log->push_back(ScopeEvent{ScopeEvent::Push, nullptr, 0, TYPE_UNKNOWN, 0});
     }
 
     void pop() {
-        if (!scopes.empty()) {
-            scopes.pop_back();
-        } else {
+        if (scopeStart.empty()) {
             std::cerr << "Warning: tried to pop empty symbol stack\n";
+            return;
+        }
+        DECAF_COUNT(++stats.pops);
+        int start = scopeStart.back();
+        scopeStart.pop_back();
+        if (envArena) {
+            env = envStack.back();
+            envStack.pop_back();
+        }
+        if (log) log->push_back(ScopeEvent{ScopeEvent::Pop, nullptr, 0, TYPE_UNKNOWN, 0});
+        while ((int)bindings.size() > start) {
+            Binding &b = bindings.back();
+            heads[b.desc.name] = b.shadowed;
+            bindings.pop_back();
         }
     }
 
-    bool insert(const std::string &name, DecafType type, int line) {
-        if (scopes.empty()) push(); // ensure at least one scope
-        return scopes.back().insert(name, type, line);
+    bool insert(SymbolId name, DecafType type, int line, decafAST *node = nullptr) {
+        if (scopeStart.empty()) push(); // ensure at least one scope
+        int depth = scopeStart.size() - 1;
+        if (name >= heads.size()) heads.resize(name + 1, -1);
+        int prev = heads[name];
+        DECAF_COUNT(++stats.inserts; if (prev >= 0) ++stats.insertCollisions);
+        if (prev >= 0 && bindings[prev].depth == depth) return false;
+        DeclId id = NoDecl;
+        if (table) {
+            int slot = bindings.size() - scopeStart.back();
+            const DeclInfo *d = table->add(DeclInfo{node, name, type, line, depthBase + depth, slot, NoDecl});
+            id = d->id;
+            if (envArena) env = env.with(name, d, *envArena);
+        }
+        bindings.push_back(Binding{SymDescriptor(name, type, line, id), prev, depth});
+        heads[name] = bindings.size() - 1;
+        if (log) log->push_back(ScopeEvent{ScopeEvent::Insert, node, name, type, line});
+        return true;
     }
 
-    SymDescriptor* lookup(const std::string &name) {
-        for (int i = scopes.size() - 1; i >= 0; --i) {
-            SymDescriptor* result = scopes[i].lookup(name);
-            if (result) return result;
+    SymDescriptor* lookup(SymbolId name) {
+        DECAF_COUNT(++stats.lookups);
+        if (name < heads.size() && heads[name] >= 0) {
+            DECAF_COUNT(stats.walked(scopeStart.size() - bindings[heads[name]].depth));
+            return &bindings[heads[name]].desc;
         }
+        int walked = scopeStart.size();
+        SymDescriptor *d = outer ? outer->lookupBefore(name, outerLimit, walked) : nullptr;
+        DECAF_COUNT(stats.walked(walked));
+        return d;
+    }
+
+    // As above, and stores the declaration's id in `ref` (NoDecl if none).
+    SymDescriptor* lookup(SymbolId name, DeclId &ref) {
+        SymDescriptor *d = lookup(name);
+        ref = d ? d->id : NoDecl;
+        if (table) table->noteUse(&ref);
+        return d;
+    }
+
+    // The table entry for an id handed out here or by an outer stack.
+    const DeclInfo* declInfo(DeclId id) const {
+        if (table && table->contains(id)) return &(*table)[id];
+        return outer ? outer->declInfo(id) : nullptr;
+    }
+
+    // Innermost binding of `name` among the first `limit` bindings. Adds the
+    // scopes searched here to `walked`.
+    SymDescriptor* lookupBefore(SymbolId name, int limit, int &walked) {
+        if (name < heads.size()) {
+            for (int b = heads[name]; b >= 0; b = bindings[b].shadowed) {
+                if (b < limit) {
+                    walked += scopeStart.size() - bindings[b].depth;
+                    return &bindings[b].desc;
+                }
+            }
+        }
+        walked += scopeStart.size();
+        if (outer) return outer->lookupBefore(name, outerLimit, walked);
         return nullptr;
     }
-    
+
+    // Calls fn(desc) for each of the first `limit` bindings, oldest first.
+    template <class Fn>
+    void forEachBinding(int limit, Fn fn) const {
+        for (int i = 0; i < limit && i < (int)bindings.size(); ++i) fn(bindings[i].desc);
+    }
+
     void print() const {
-        for (int i = scopes.size() - 1; i >= 0; --i) {
+        int end = bindings.size();
+        for (int i = scopeStart.size() - 1; i >= 0; --i) {
             std::cout << "Scope " << i << ":\n";
-            scopes[i].print();
+            for (int j = scopeStart[i]; j < end; ++j) {
+                const SymDescriptor &d = bindings[j].desc;
+                std::cout << "  " << gNames.spelling(d.name) << " : "
+                          << typeToString(d.type)
+                          << " (declared on line " << d.lineDeclared << ")\n";
+            }
+            end = scopeStart[i];
         }
-        
     }
 };
 
@@ -108,6 +314,7 @@ public:
 
 
 
-extern SymbolStack gSym;
+extern thread_local SymbolStack gSym;
+extern thread_local BindingTable gDecls;
 
 #endif // SYMBOLTABLE_H
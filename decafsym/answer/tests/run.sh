@@ -0,0 +1,99 @@
+#!/bin/sh
+# Tests of decafsym's own options, beyond the course's testcases/references.
+# usage: sh tests/run.sh [path-to-decafsym]   (run from answer/)
+
+decafsym=${1:-./decafsym}
+tests=$(dirname "$0")
+failed=0
+
+# expect <name> <expected-file> <actual-file>
+expect() {
+  if cmp -s "$2" "$3"; then
+    echo "ok   $1"
+  else
+    echo "FAIL $1"
+    diff "$2" "$3" | head -20
+    failed=1
+  fi
+}
+
+tmp=$(mktemp -d) || exit 2
+trap 'rm -rf "$tmp"' EXIT
+
+# --check: every testcases/dev program prints and reports exactly what the
+# original compiler did (tests/conformance, from ../output.zip)
+if "$decafsym" --check ../testcases "$tests/conformance" > "$tmp/check.out" 2>&1 &&
+   ! grep -q '✗' "$tmp/check.out"; then
+  echo "ok   conformance"
+else
+  echo "FAIL conformance"
+  grep '✗' "$tmp/check.out" | head -20
+  failed=1
+fi
+
+# --diagnostics=json: one object per message, traces included
+"$decafsym" --diagnostics=json < "$tests/json/errors.decaf" > /dev/null 2> "$tmp/json.err"
+expect json "$tests/json/errors.err" "$tmp/json.err"
+
+# --no-traces: the same errors as text, without the "defined variable" lines
+"$decafsym" --no-traces < "$tests/json/errors.decaf" > /dev/null 2> "$tmp/notraces.err"
+expect no-traces "$tests/json/errors.notraces.err" "$tmp/notraces.err"
+
+# --typecheck: bodies analyzed on worker threads must report what the
+# serial walk does, down to the unnamed expressions
+for t in 1 4; do
+  "$decafsym" --typecheck -t $t < "$tests/typecheck/mismatch.decaf" > /dev/null 2> "$tmp/typecheck$t.err"
+  expect "typecheck -t $t" "$tests/typecheck/mismatch.err" "$tmp/typecheck$t.err"
+done
+
+# --cache: entries damaged past their header are analyzed afresh, not trusted
+mkdir "$tmp/cache"
+"$decafsym" --typecheck < "$tests/typecheck/mismatch.decaf" > "$tmp/fresh.out" 2> "$tmp/fresh.err"
+"$decafsym" --typecheck --cache "$tmp/cache" < "$tests/typecheck/mismatch.decaf" > /dev/null 2>&1
+for entry in "$tmp/cache"/*; do
+  printf '\377\377\377\377\377\377\377\377' | dd of="$entry" bs=1 seek=16 conv=notrunc 2> /dev/null
+done
+"$decafsym" --typecheck --cache "$tmp/cache" < "$tests/typecheck/mismatch.decaf" > "$tmp/damaged.out" 2> "$tmp/damaged.err"
+expect "damaged cache (out)" "$tmp/fresh.out" "$tmp/damaged.out"
+expect "damaged cache (err)" "$tmp/fresh.err" "$tmp/damaged.err"
+
+# --cache: retyping a callee's parameter on the same line changes what its
+# callers' argument checks report, so their entries must not be replayed
+sed '10s/b bool/b int/' "$tests/typecheck/mismatch.decaf" > "$tmp/retyped.decaf"
+"$decafsym" --typecheck < "$tmp/retyped.decaf" > "$tmp/retyped.out" 2> "$tmp/retyped.err"
+"$decafsym" --typecheck --cache "$tmp/cache" < "$tmp/retyped.decaf" > "$tmp/cached.out" 2> "$tmp/cached.err"
+expect "retyped callee (out)" "$tmp/retyped.out" "$tmp/cached.out"
+expect "retyped callee (err)" "$tmp/retyped.err" "$tmp/cached.err"
+
+# --mmap: string constants stay in the mapped source rather than being
+# copied (DECAF_STATS builds only; others print no counters)
+"$decafsym" --mmap --stats -o "$tmp/mmap" "$tests/mmap/strings.decaf" 2> "$tmp/mmap.stats"
+inplace=$(sed -n 's/^ *string bytes in place *//p' "$tmp/mmap.stats")
+if [ -z "$inplace" ]; then
+  echo "skip mmap in place (not a DECAF_STATS build)"
+elif [ "$inplace" -gt 0 ]; then
+  echo "ok   mmap in place"
+else
+  echo "FAIL mmap in place (the grammar does not define DECAF_PARSE_BUFFER?)"
+  grep 'string bytes' "$tmp/mmap.stats"
+  failed=1
+fi
+
+# --ast-cache: an image whose header names another node layout is rejected,
+# and the file is compiled from source and its image written again
+mkdir "$tmp/src"
+cp "$tests/typecheck/mismatch.decaf" "$tmp/src/"
+"$decafsym" --ast-cache -o "$tmp/ast1" "$tmp/src/mismatch.decaf"
+cp "$tmp/src/mismatch.decaf.ast" "$tmp/good.ast"
+printf '\377\377\377\377' | dd of="$tmp/src/mismatch.decaf.ast" bs=1 seek=8 conv=notrunc 2> /dev/null
+"$decafsym" --ast-cache -o "$tmp/ast2" "$tmp/src/mismatch.decaf"
+expect "ast image layout (rewritten)" "$tmp/good.ast" "$tmp/src/mismatch.decaf.ast"
+if diff -r "$tmp/ast1" "$tmp/ast2" > /dev/null; then
+  echo "ok   ast image layout (output)"
+else
+  echo "FAIL ast image layout (output)"
+  diff -r "$tmp/ast1" "$tmp/ast2" | head -20
+  failed=1
+fi
+
+exit $failed
@@ -0,0 +1,104 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that run one parallelFor() at a time. The
+// calling thread takes part as worker 0, so a pool of size 1 starts no
+// threads and runs everything inline.
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex               mu;
+    std::condition_variable  wake, done;
+
+    std::function<void(unsigned)> job;   // runs one worker's share
+    unsigned long generation = 0;        // bumped for every job
+    unsigned busy = 0;                   // workers still inside the job
+    bool     running = false;            // a parallelFor() owns the workers
+    bool     stopping = false;
+
+    void workerLoop(unsigned id) {
+        unsigned long seen = 0;
+        for (;;) {
+            std::unique_lock<std::mutex> lock(mu);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            std::function<void(unsigned)> fn = job;
+            lock.unlock();
+            fn(id);
+            lock.lock();
+            if (--busy == 0) done.notify_one();
+        }
+    }
+
+public:
+    explicit ThreadPool(unsigned threads) {
+        if (threads == 0) threads = defaultThreads();
+        for (unsigned i = 1; i < threads; ++i)
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &t : workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    static unsigned defaultThreads() {
+        unsigned n = std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+
+    unsigned size() const { return workers.size() + 1; }
+
+    // Calls fn(i, worker) for every i in [0, n). Items are handed out one at
+    // a time in increasing order; `worker` is below size() and identifies the
+    // calling thread, for per-thread scratch state. Returns when all are done.
+    // A call made while another thread's parallelFor() holds the workers runs
+    // inline on the caller instead of waiting.
+    template <class Fn>
+    void parallelFor(size_t n, Fn fn) {
+        bool inline_ = workers.empty() || n <= 1;
+        if (!inline_) {
+            std::lock_guard<std::mutex> lock(mu);
+            inline_ = running;
+            running = true;
+        }
+        if (inline_) {
+            for (size_t i = 0; i < n; ++i) fn(i, 0u);
+            return;
+        }
+        std::atomic<size_t> next(0);
+        auto share = [&](unsigned worker) {
+            for (size_t i; (i = next.fetch_add(1)) < n; )
+                fn(i, worker);
+        };
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            job = share;
+            busy = workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+        share(0);
+        std::unique_lock<std::mutex> lock(mu);
+        done.wait(lock, [&] { return busy == 0; });
+        job = nullptr;
+        running = false;
+    }
+};
+
+#endif // THREAD_POOL_H